@@ -38,6 +38,9 @@
 #include <openssl/pem.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
+#ifndef OPENSSL_NO_ECDSA
+#include <openssl/ecdsa.h>
+#endif
 #include <openssl/engine.h>
 #include <openssl/err.h>
 
@@ -64,7 +67,16 @@ static int	 rsae_init(RSA *);
 static int	 rsae_finish(RSA *);
 static int	 rsae_keygen(RSA *, int, BIGNUM *, BN_GENCB *);
 
-static uint64_t	 rsae_reqid = 0;
+#ifndef OPENSSL_NO_ECDSA
+static ECDSA_SIG *ecdsae_do_sign(const unsigned char *, int, const BIGNUM *,
+		    const BIGNUM *, EC_KEY *);
+static void	 ca_engine_init_ecdsa(ENGINE *);
+#endif
+
+static int	 ca_send_imsg(unsigned int, const char *, const void *, size_t,
+		    void *, size_t, size_t);
+
+static uint64_t	 ca_reqid = 0;
 
 static void
 ca_shutdown(void)
@@ -107,7 +119,7 @@ ca(void)
 	config_peer(PROC_PARENT);
 	config_peer(PROC_PONY);
 
-	/* Ignore them until we get our config */
+	/* Ignore it until we get our config */
 	mproc_disable(p_pony);
 
 	if (pledge("stdio", NULL) == -1)
@@ -219,6 +231,12 @@ void
 ca_imsg(struct mproc *p, struct imsg *imsg)
 {
 	RSA			*rsa;
+#ifndef OPENSSL_NO_ECDSA
+	EC_KEY			*ecdsa;
+	ECDSA_SIG		*sig;
+	unsigned char		*buf;
+	int			 buflen;
+#endif
 	const void		*from = NULL;
 	unsigned char		*to = NULL;
 	struct msg		 m;
@@ -304,6 +322,38 @@ ca_imsg(struct mproc *p, struct imsg *imsg)
 			RSA_free(rsa);
 
 			return;
+
+#ifndef OPENSSL_NO_ECDSA
+		case IMSG_CA_ECDSA_SIGN:
+			m_msg(&m, imsg);
+			m_get_id(&m, &id);
+			m_get_string(&m, &pkiname);
+			m_get_data(&m, &from, &flen);
+			m_end(&m);
+
+			pki = dict_get(env->sc_pki_dict, pkiname);
+			if (pki == NULL || pki->pki_pkey == NULL ||
+			    (ecdsa = EVP_PKEY_get1_EC_KEY(pki->pki_pkey)) == NULL)
+				fatalx("ca_imsg: invalid pki");
+
+			buf = NULL;
+			buflen = 0;
+			if ((sig = ECDSA_do_sign(from, flen, ecdsa)) != NULL)
+				buflen = i2d_ECDSA_SIG(sig, &buf);
+
+			m_create(p, imsg->hdr.type, 0, 0, -1);
+			m_add_id(p, id);
+			m_add_int(p, buflen);
+			if (buflen > 0)
+				m_add_data(p, buf, (size_t)buflen);
+			m_close(p);
+
+			free(buf);
+			ECDSA_SIG_free(sig);
+			EC_KEY_free(ecdsa);
+
+			return;
+#endif
 		}
 	}
 
@@ -333,34 +383,34 @@ static RSA_METHOD rsae_method = {
 	rsae_keygen
 };
 
+/*
+ * Send a synchronous request to the ca process, because we cannot defer
+ * the private key operation in OpenSSL's engine layer.  With several
+ * pony workers, each one has its own ca process so requests from
+ * different workers are served in parallel.
+ */
 static int
-rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
-    RSA *rsa, int padding, unsigned int cmd)
+ca_send_imsg(unsigned int cmd, const char *pkiname, const void *from,
+    size_t flen, void *to, size_t tsize, size_t padding)
 {
 	int		 ret = 0;
 	struct imsgbuf	*ibuf;
 	struct imsg	 imsg;
 	int		 n, done = 0;
 	const void	*toptr;
-	char		*pkiname;
 	size_t		 tlen;
 	struct msg	 m;
 	uint64_t	 id;
 
-	if ((pkiname = RSA_get_ex_data(rsa, 0)) == NULL)
-		return (0);
-
-	/*
-	 * Send a synchronous imsg because we cannot defer the RSA
-	 * operation in OpenSSL's engine layer.
-	 */
 	m_create(p_ca, cmd, 0, 0, -1);
-	rsae_reqid++;
-	m_add_id(p_ca, rsae_reqid);
+	ca_reqid++;
+	m_add_id(p_ca, ca_reqid);
 	m_add_string(p_ca, pkiname);
-	m_add_data(p_ca, (const void *)from, (size_t)flen);
-	m_add_size(p_ca, (size_t)RSA_size(rsa));
-	m_add_size(p_ca, (size_t)padding);
+	m_add_data(p_ca, from, flen);
+	if (cmd != IMSG_CA_ECDSA_SIGN) {
+		m_add_size(p_ca, tsize);
+		m_add_size(p_ca, padding);
+	}
 	m_flush(p_ca);
 
 	ibuf = &p_ca->imsgbuf;
@@ -379,11 +429,7 @@ rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
 
 			log_imsg(PROC_PONY, PROC_CA, &imsg);
 
-			switch (imsg.hdr.type) {
-			case IMSG_CA_PRIVENC:
-			case IMSG_CA_PRIVDEC:
-				break;
-			default:
+			if (imsg.hdr.type != cmd) {
 				/* Another imsg is queued up in the buffer */
 				pony_imsg(p_ca, &imsg);
 				imsg_free(&imsg);
@@ -392,15 +438,18 @@ rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
 
 			m_msg(&m, &imsg);
 			m_get_id(&m, &id);
-			if (id != rsae_reqid)
+			if (id != ca_reqid)
 				fatalx("invalid response id");
 			m_get_int(&m, &ret);
 			if (ret > 0)
 				m_get_data(&m, &toptr, &tlen);
 			m_end(&m);
 
-			if (ret > 0)
+			if (ret > 0) {
+				if (tlen > tsize)
+					fatalx("invalid response size");
 				memcpy(to, toptr, tlen);
+			}
 			done = 1;
 
 			imsg_free(&imsg);
@@ -411,6 +460,19 @@ rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
 	return (ret);
 }
 
+static int
+rsae_send_imsg(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding, unsigned int cmd)
+{
+	char		*pkiname;
+
+	if ((pkiname = RSA_get_ex_data(rsa, 0)) == NULL)
+		return (0);
+
+	return (ca_send_imsg(cmd, pkiname, from, (size_t)flen, to,
+	    (size_t)RSA_size(rsa), (size_t)padding));
+}
+
 static int
 rsae_pub_enc(int flen,const unsigned char *from, unsigned char *to, RSA *rsa,
     int padding)
@@ -491,6 +553,77 @@ rsae_keygen(RSA *rsa, int bits, BIGNUM *e, BN_GENCB *cb)
 	return (rsa_default->rsa_keygen(rsa, bits, e, cb));
 }
 
+#ifndef OPENSSL_NO_ECDSA
+/*
+ * ECDSA privsep engine (called from unprivileged processes)
+ */
+
+const ECDSA_METHOD *ecdsa_default = NULL;
+static ECDSA_METHOD *ecdsae_method = NULL;
+
+static ECDSA_SIG *
+ecdsae_do_sign(const unsigned char *dgst, int dgst_len, const BIGNUM *inv,
+    const BIGNUM *rp, EC_KEY *eckey)
+{
+	unsigned char		 buf[256];
+	const unsigned char	*d;
+	char			*pkiname;
+	int			 ret;
+
+	log_debug("debug: %s: %s", proc_name(smtpd_process), __func__);
+	if ((pkiname = ECDSA_get_ex_data(eckey, 0)) == NULL) {
+		/* not a privsep key, sign it here */
+		ECDSA_set_method(eckey, ecdsa_default);
+		return (ECDSA_do_sign_ex(dgst, dgst_len, inv, rp, eckey));
+	}
+
+	if ((size_t)ECDSA_size(eckey) > sizeof(buf))
+		return (NULL);
+
+	ret = ca_send_imsg(IMSG_CA_ECDSA_SIGN, pkiname, dgst,
+	    (size_t)dgst_len, buf, sizeof(buf), 0);
+	if (ret <= 0)
+		return (NULL);
+
+	d = buf;
+	return (d2i_ECDSA_SIG(NULL, &d, ret));
+}
+
+static void
+ca_engine_init_ecdsa(ENGINE *e)
+{
+	const char	*errstr;
+
+	if ((ecdsa_default = ENGINE_get_ECDSA(e)) == NULL &&
+	    (ecdsa_default = ECDSA_get_default_method()) == NULL) {
+		errstr = "ECDSA_get_default_method";
+		goto fail;
+	}
+
+	if ((ecdsae_method = ECDSA_METHOD_new(ecdsa_default)) == NULL) {
+		errstr = "ECDSA_METHOD_new";
+		goto fail;
+	}
+	ECDSA_METHOD_set_name(ecdsae_method, "ECDSA privsep engine");
+	ECDSA_METHOD_set_sign(ecdsae_method, ecdsae_do_sign);
+
+	if (!ENGINE_set_ECDSA(e, ecdsae_method)) {
+		errstr = "ENGINE_set_ECDSA";
+		goto fail;
+	}
+	if (!ENGINE_set_default_ECDSA(e)) {
+		errstr = "ENGINE_set_default_ECDSA";
+		goto fail;
+	}
+
+	return;
+
+ fail:
+	ssl_error(errstr);
+	fatalx("%s", errstr);
+}
+#endif
+
 void
 ca_engine_init(void)
 {
@@ -542,6 +675,10 @@ ca_engine_init(void)
 		goto fail;
 	}
 
+#ifndef OPENSSL_NO_ECDSA
+	ca_engine_init_ecdsa(e);
+#endif
+
 	return;
 
  fail:
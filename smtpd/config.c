@@ -122,6 +122,7 @@ void
 config_peer(enum smtp_proc_type proc)
 {
 	struct mproc	*p;
+	int		 i;
 
 	if (proc == smtpd_process)
 		fatal("config_peers: cannot peer with oneself");
@@ -136,10 +137,19 @@ config_peer(enum smtp_proc_type proc)
 		p = p_queue;
 	else if (proc == PROC_SCHEDULER)
 		p = p_scheduler;
-	else if (proc == PROC_PONY)
-		p = p_pony;
-	else if (proc == PROC_CA)
-		p = p_ca;
+	else if (proc == PROC_PONY) {
+		/* a ca process only peers with its own pony worker */
+		for (i = 0; i < env->sc_pony_workers; i++)
+			if (p_ponies[i])
+				mproc_enable(p_ponies[i]);
+		return;
+	}
+	else if (proc == PROC_CA) {
+		for (i = 0; i < env->sc_pony_workers; i++)
+			if (p_cas[i])
+				mproc_enable(p_cas[i]);
+		return;
+	}
 	else
 		fatalx("bad peer");
 
@@ -54,6 +54,8 @@ struct ctl_conn {
 	struct mproc		 mproc;
 	uid_t			 euid;
 	gid_t			 egid;
+	int			 pending;	/* pony replies expected */
+	int			 failed;	/* a pony reply was a failure */
 };
 
 struct {
@@ -146,6 +148,24 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 			c = tree_get(&ctl_conns, imsg->hdr.peerid);
 			if (c == NULL)
 				return;
+			/*
+			 * The request went to every pony worker: only pass
+			 * the last reply or end-of-list marker to the client,
+			 * and report a failure if any of the workers failed.
+			 */
+			if (imsg->hdr.type == IMSG_CTL_FAIL)
+				c->failed = 1;
+			if ((imsg->hdr.type == IMSG_CTL_OK ||
+			    imsg->hdr.type == IMSG_CTL_FAIL ||
+			    imsg->hdr.len == IMSG_HEADER_SIZE) &&
+			    c->pending > 1) {
+				c->pending--;
+				return;
+			}
+			if (imsg->hdr.type == IMSG_CTL_OK && c->failed)
+				imsg->hdr.type = IMSG_CTL_FAIL;
+			c->pending = 0;
+			c->failed = 0;
 			imsg->hdr.peerid = 0;
 			m_forward(&c->mproc, imsg);
 			return;
@@ -456,6 +476,7 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 	int			 v;
 	struct stat_kv		*kvp;
 	char			*key;
+	int			 i;
 	struct stat_value	 val;
 	size_t			 len;
 	uint64_t		 evpid;
@@ -627,7 +648,9 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp paused");
 		env->sc_flags |= SMTPD_SMTP_PAUSED;
-		m_compose(p_pony, IMSG_CTL_PAUSE_SMTP, 0, 0, -1, NULL, 0);
+		for (i = 0; i < env->sc_pony_workers; i++)
+			m_compose(p_ponies[i], IMSG_CTL_PAUSE_SMTP, 0, 0, -1,
+			    NULL, 0);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -677,7 +700,8 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp resumed");
 		env->sc_flags &= ~SMTPD_SMTP_PAUSED;
-		m_forward(p_pony, imsg);
+		for (i = 0; i < env->sc_pony_workers; i++)
+			m_forward(p_ponies[i], imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -685,8 +709,11 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (c->euid)
 			goto badcred;
 
-		m_forward(p_pony, imsg);
-		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
+		imsg->hdr.peerid = c->id;
+		c->pending = env->sc_pony_workers;
+		c->failed = 0;
+		for (i = 0; i < env->sc_pony_workers; i++)
+			m_forward(p_ponies[i], imsg);
 		return;
 
 	case IMSG_CTL_LIST_MESSAGES:
@@ -712,7 +739,10 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 			goto badcred;
 
 		imsg->hdr.peerid = c->id;
-		m_forward(p_pony, imsg);
+		c->pending = env->sc_pony_workers;
+		c->failed = 0;
+		for (i = 0; i < env->sc_pony_workers; i++)
+			m_forward(p_ponies[i], imsg);
 		return;
 
 	case IMSG_CTL_SHOW_STATUS:
@@ -731,10 +761,15 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		if (imsg->hdr.len - IMSG_HEADER_SIZE <= sizeof(ss))
 			goto invalid;
 		memmove(&ss, imsg->data, sizeof(ss));
-		m_create(p_pony, imsg->hdr.type, c->id, 0, -1);
-		m_add_sockaddr(p_pony, (struct sockaddr *)&ss);
-		m_add_string(p_pony, (char *)imsg->data + sizeof(ss));
-		m_close(p_pony);
+		c->pending = env->sc_pony_workers;
+		c->failed = 0;
+		for (i = 0; i < env->sc_pony_workers; i++) {
+			m_create(p_ponies[i], imsg->hdr.type, c->id, 0, -1);
+			m_add_sockaddr(p_ponies[i], (struct sockaddr *)&ss);
+			m_add_string(p_ponies[i],
+			    (char *)imsg->data + sizeof(ss));
+			m_close(p_ponies[i]);
+		}
 		return;
 
 	case IMSG_CTL_SCHEDULE:
@@ -807,21 +842,27 @@ invalid:
 static void
 control_broadcast_verbose(int msg, int v)
 {
+	int	i;
+
 	m_create(p_lka, msg, 0, 0, -1);
 	m_add_int(p_lka, v);
 	m_close(p_lka);
 
-	m_create(p_pony, msg, 0, 0, -1);
-	m_add_int(p_pony, v);
-	m_close(p_pony);
+	for (i = 0; i < env->sc_pony_workers; i++) {
+		m_create(p_ponies[i], msg, 0, 0, -1);
+		m_add_int(p_ponies[i], v);
+		m_close(p_ponies[i]);
+	}
 
 	m_create(p_queue, msg, 0, 0, -1);
 	m_add_int(p_queue, v);
 	m_close(p_queue);
 
-	m_create(p_ca, msg, 0, 0, -1);
-	m_add_int(p_ca, v);
-	m_close(p_ca);
+	for (i = 0; i < env->sc_pony_workers; i++) {
+		m_create(p_cas[i], msg, 0, 0, -1);
+		m_add_int(p_cas[i], v);
+		m_close(p_cas[i]);
+	}
 
 	m_create(p_scheduler, msg, 0, 0, -1);
 	m_add_int(p_scheduler, v);
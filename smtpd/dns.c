@@ -40,6 +40,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
 #include "smtpd.h"
 #include "log.h"
@@ -49,11 +50,43 @@
 #define asr_freeaddrinfo(x)	do { } while(0);
 #endif
 
+#define DNS_CACHE_TTL		300	/* cap on positive answers */
+#define DNS_CACHE_NEGTTL	60	/* cap on negative answers */
+#define DNS_CACHE_MEMORY	(4 * 1024 * 1024)
+#define DNS_CACHE_PREFETCH	10	/* refresh in the last tenth of the TTL */
+#define DNS_HOST_TIMEOUT	10	/* seconds, for each MX host lookup */
+
 struct dns_lookup {
+	TAILQ_ENTRY(dns_lookup)	 entry;
 	struct dns_session	*session;
+	struct event_asr	*eva;
+	struct event		 ev;
+	int			 preference;
+	int			 done;
+	int			 sent;
+	size_t			 first;
+	size_t			 naddr;
+};
+
+struct dns_addr {
+	struct sockaddr_storage	 ss;
 	int			 preference;
 };
 
+struct dns_answer {
+	int			 error;
+	char			 ptrname[HOST_NAME_MAX+1];
+	size_t			 naddr;
+	struct dns_addr		*addrs;
+};
+
+struct dns_waiter {
+	TAILQ_ENTRY(dns_waiter)	 entry;
+	struct mproc		*p;
+	uint64_t		 reqid;
+	int			 type;
+};
+
 struct dns_session {
 	struct mproc		*p;
 	uint64_t		 reqid;
@@ -62,13 +95,55 @@ struct dns_session {
 	size_t			 mxfound;
 	int			 error;
 	int			 refcount;
+
+	/* cached lookups */
+	char			*key;
+	struct sockaddr_storage	 ss;
+	uint32_t		 ttl;
+	struct dns_answer	 answer;
+	TAILQ_HEAD(, dns_waiter) waiters;
+	TAILQ_HEAD(, dns_lookup) lookups;
+};
+
+struct dns_entry {
+	TAILQ_ENTRY(dns_entry)	 entry;
+	char			*key;
+	int			 type;
+	struct sockaddr_storage	 ss;
+	time_t			 expire;
+	time_t			 ttl;
+	size_t			 hits;
+	size_t			 size;
+	struct dns_answer	 answer;
 };
 
 static void dns_lookup_host(struct dns_session *, const char *, int);
 static void dns_dispatch_host(struct asr_result *, void *);
+static void dns_timeout_host(int, short, void *);
+static void dns_host_done(struct dns_lookup *);
+static void dns_release(struct dns_session *);
 static void dns_dispatch_ptr(struct asr_result *, void *);
 static void dns_dispatch_mx(struct asr_result *, void *);
 static void dns_dispatch_mx_preference(struct asr_result *, void *);
+static struct dns_session *dns_request(struct mproc *, int, uint64_t,
+    const char *, int);
+static struct dns_session *dns_session(const char *, int);
+static void dns_wait(struct dns_session *, struct mproc *, int, uint64_t);
+static void dns_start(struct dns_session *);
+static void dns_done(struct dns_session *);
+static void dns_reply(struct mproc *, int, uint64_t, struct dns_answer *);
+static void dns_reply_addrs(struct mproc *, uint64_t, struct dns_addr *,
+    size_t);
+static void dns_reply_end(struct mproc *, uint64_t, int);
+static uint32_t dns_negative_ttl(struct asr_result *);
+static void dns_cache_insert(struct dns_session *, time_t);
+static void dns_cache_remove(struct dns_entry *);
+
+static int			 dns_init;
+static struct dict		 dns_sessions;
+static struct dict		 dns_cache;
+static TAILQ_HEAD(, dns_entry)	 dns_lru;
+static size_t			 dns_cachesize;
 
 struct unpack {
 	const char	*buf;
@@ -203,21 +278,33 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 	struct asr_query	*as;
 	struct msg		 m;
 	const char		*domain, *mx, *host;
+	char			 key[HOST_NAME_MAX+16];
 	socklen_t		 sl;
+	uint64_t		 reqid;
+	int			 type;
 
-	s = xcalloc(1, sizeof *s, "dns_imsg");
-	s->type = imsg->hdr.type;
-	s->p = p;
+	if (!dns_init) {
+		dict_init(&dns_sessions);
+		dict_init(&dns_cache);
+		TAILQ_INIT(&dns_lru);
+		dns_init = 1;
+	}
+
+	type = imsg->hdr.type;
 
 	m_msg(&m, imsg);
-	m_get_id(&m, &s->reqid);
+	m_get_id(&m, &reqid);
 
-	switch (s->type) {
+	switch (type) {
 
 	case IMSG_MTA_DNS_HOST:
 		m_get_string(&m, &host);
 		m_end(&m);
-		dns_lookup_host(s, host, -1);
+		(void)snprintf(key, sizeof(key), "host:%s", host);
+		if ((s = dns_request(p, type, reqid, key, type)) == NULL)
+			return;
+		(void)strlcpy(s->name, host, sizeof(s->name));
+		dns_start(s);
 		return;
 
 	case IMSG_MTA_DNS_PTR:
@@ -225,52 +312,52 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 		sa = (struct sockaddr *)&ss;
 		m_get_sockaddr(&m, sa);
 		m_end(&m);
-		as = getnameinfo_async(sa, SA_LEN(sa), s->name, sizeof(s->name),
-		    NULL, 0, 0, NULL);
-		event_asr_run(as, dns_dispatch_ptr, s);
+		(void)snprintf(key, sizeof(key), "ptr:%s", sa_to_text(sa));
+		s = dns_request(p, type, reqid, key, IMSG_MTA_DNS_PTR);
+		if (s == NULL)
+			return;
+		memmove(&s->ss, sa, SA_LEN(sa));
+		dns_start(s);
 		return;
 
 	case IMSG_MTA_DNS_MX:
 		m_get_string(&m, &domain);
 		m_end(&m);
-		(void)strlcpy(s->name, domain, sizeof(s->name));
 
 		sa = (struct sockaddr *)&ss;
 		sl = sizeof(ss);
 
 		if (domainname_is_addr(domain, sa, &sl)) {
-			m_create(s->p, IMSG_MTA_DNS_HOST, 0, 0, -1);
-			m_add_id(s->p, s->reqid);
-			m_add_sockaddr(s->p, sa);
-			m_add_int(s->p, -1);
-			m_close(s->p);
-
-			m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-			m_add_id(s->p, s->reqid);
-			m_add_int(s->p, DNS_OK);
-			m_close(s->p);
-			free(s);
+			m_create(p, IMSG_MTA_DNS_HOST, 0, 0, -1);
+			m_add_id(p, reqid);
+			m_add_sockaddr(p, sa);
+			m_add_int(p, -1);
+			m_close(p);
+
+			m_create(p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
+			m_add_id(p, reqid);
+			m_add_int(p, DNS_OK);
+			m_close(p);
 			return;
 		}
 
-		as = res_query_async(s->name, C_IN, T_MX, NULL);
-		if (as == NULL) {
-			log_warn("warn: req_query_async: %s", s->name);
-			m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-			m_add_id(s->p, s->reqid);
-			m_add_int(s->p, DNS_EINVAL);
-			m_close(s->p);
-			free(s);
+		(void)snprintf(key, sizeof(key), "mx:");
+		(void)lowercase(key + 3, domain, sizeof(key) - 3);
+		if ((s = dns_request(p, type, reqid, key, type)) == NULL)
 			return;
-		}
-
-		event_asr_run(as, dns_dispatch_mx, s);
+		(void)strlcpy(s->name, domain, sizeof(s->name));
+		dns_start(s);
 		return;
 
 	case IMSG_MTA_DNS_MX_PREFERENCE:
 		m_get_string(&m, &domain);
 		m_get_string(&m, &mx);
 		m_end(&m);
+
+		s = xcalloc(1, sizeof *s, "dns_imsg");
+		s->type = type;
+		s->p = p;
+		s->reqid = reqid;
 		(void)strlcpy(s->name, mx, sizeof(s->name));
 
 		as = res_query_async(domain, C_IN, T_MX, NULL);
@@ -287,43 +374,400 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 		return;
 
 	default:
-		log_warnx("warn: bad dns request %d", s->type);
+		log_warnx("warn: bad dns request %d", type);
 		fatal(NULL);
 	}
 }
 
+/*
+ * Answer a request from the cache, or attach it to the lookup already
+ * running for the same key.  Otherwise, return a new session that the
+ * caller must start.
+ */
+static struct dns_session *
+dns_request(struct mproc *p, int type, uint64_t reqid, const char *key,
+    int lookup)
+{
+	struct dns_session	*s;
+	struct dns_entry	*e;
+	struct dns_lookup	*l;
+	time_t			 now;
+
+	now = time(NULL);
+	if ((e = dict_get(&dns_cache, key)) != NULL && e->expire <= now) {
+		dns_cache_remove(e);
+		e = NULL;
+	}
+	s = dict_get(&dns_sessions, key);
+
+	if (e) {
+		stat_increment("dns.cache.hit", 1);
+		e->hits++;
+		TAILQ_REMOVE(&dns_lru, e, entry);
+		TAILQ_INSERT_TAIL(&dns_lru, e, entry);
+		dns_reply(p, type, reqid, &e->answer);
+
+		/* refresh hot entries before they expire */
+		if (s == NULL && e->hits > 1 &&
+		    e->expire - now <= e->ttl / DNS_CACHE_PREFETCH) {
+			stat_increment("dns.cache.prefetch", 1);
+			s = dns_session(key, e->type);
+			(void)strlcpy(s->name, strchr(key, ':') + 1,
+			    sizeof(s->name));
+			memmove(&s->ss, &e->ss, sizeof(s->ss));
+			dns_start(s);
+		}
+		return (NULL);
+	}
+
+	stat_increment("dns.cache.miss", 1);
+	if (s) {
+		/* catch up with the results already sent to the others */
+		dns_wait(s, p, type, reqid);
+		TAILQ_FOREACH(l, &s->lookups, entry)
+			if (l->sent)
+				dns_reply_addrs(p, reqid,
+				    s->answer.addrs + l->first, l->naddr);
+		return (NULL);
+	}
+
+	s = dns_session(key, lookup);
+	dns_wait(s, p, type, reqid);
+	return (s);
+}
+
+static struct dns_session *
+dns_session(const char *key, int lookup)
+{
+	struct dns_session	*s;
+
+	s = xcalloc(1, sizeof *s, "dns_session");
+	s->type = lookup;
+	s->key = xstrdup(key, "dns_session");
+	TAILQ_INIT(&s->waiters);
+	TAILQ_INIT(&s->lookups);
+	dict_xset(&dns_sessions, s->key, s);
+
+	return (s);
+}
+
+static void
+dns_wait(struct dns_session *s, struct mproc *p, int type, uint64_t reqid)
+{
+	struct dns_waiter	*w;
+
+	w = xcalloc(1, sizeof *w, "dns_wait");
+	w->p = p;
+	w->type = type;
+	w->reqid = reqid;
+	TAILQ_INSERT_TAIL(&s->waiters, w, entry);
+}
+
+static void
+dns_start(struct dns_session *s)
+{
+	struct asr_query	*as;
+	struct sockaddr		*sa;
+
+	switch (s->type) {
+	case IMSG_MTA_DNS_HOST:
+		dns_lookup_host(s, s->name, -1);
+		break;
+
+	case IMSG_MTA_DNS_PTR:
+		sa = (struct sockaddr *)&s->ss;
+		as = getnameinfo_async(sa, SA_LEN(sa), s->answer.ptrname,
+		    sizeof(s->answer.ptrname), NULL, 0, 0, NULL);
+		event_asr_run(as, dns_dispatch_ptr, s);
+		break;
+
+	case IMSG_MTA_DNS_MX:
+		as = res_query_async(s->name, C_IN, T_MX, NULL);
+		if (as == NULL) {
+			log_warn("warn: req_query_async: %s", s->name);
+			s->answer.error = DNS_EINVAL;
+			s->error = -1;
+			dns_done(s);
+			break;
+		}
+		event_asr_run(as, dns_dispatch_mx, s);
+		break;
+
+	default:
+		fatalx("dns_start: bad lookup %d", s->type);
+	}
+}
+
+/*
+ * A lookup is over.  Cache its answer if it is definite, and pass it
+ * to every request waiting for it.
+ */
+static void
+dns_done(struct dns_session *s)
+{
+	struct dns_waiter	*w;
+	struct dns_lookup	*l;
+	uint32_t		 ttl;
+
+	ttl = 0;
+	if (s->answer.error == DNS_OK && s->error == 0)
+		ttl = DNS_CACHE_TTL;
+	else if (s->answer.error == DNS_ENONAME ||
+	    (s->answer.error == DNS_ENOTFOUND &&
+	    (s->error == 0 || s->error == EAI_NONAME)))
+		ttl = DNS_CACHE_NEGTTL;
+	if (s->ttl && s->ttl < ttl)
+		ttl = s->ttl;
+
+	/* addresses have already been sent as the lookups finished */
+	while ((w = TAILQ_FIRST(&s->waiters))) {
+		TAILQ_REMOVE(&s->waiters, w, entry);
+		if (s->type == IMSG_MTA_DNS_PTR)
+			dns_reply(w->p, w->type, w->reqid, &s->answer);
+		else
+			dns_reply_end(w->p, w->reqid, s->answer.error);
+		free(w);
+	}
+
+	while ((l = TAILQ_FIRST(&s->lookups))) {
+		TAILQ_REMOVE(&s->lookups, l, entry);
+		free(l);
+	}
+
+	if (ttl)
+		dns_cache_insert(s, ttl);
+
+	dict_xpop(&dns_sessions, s->key);
+	free(s->answer.addrs);
+	free(s->key);
+	free(s);
+}
+
+static void
+dns_reply(struct mproc *p, int type, uint64_t reqid, struct dns_answer *a)
+{
+	switch (type) {
+	case IMSG_MTA_DNS_HOST:
+	case IMSG_MTA_DNS_MX:
+		dns_reply_addrs(p, reqid, a->addrs, a->naddr);
+		dns_reply_end(p, reqid, a->error);
+		break;
+
+	case IMSG_MTA_DNS_PTR:
+	case IMSG_SMTP_DNS_PTR:
+		m_create(p, type, 0, 0, -1);
+		m_add_id(p, reqid);
+		m_add_int(p, a->error);
+		if (a->error == DNS_OK)
+			m_add_string(p, a->ptrname);
+		m_close(p);
+		break;
+	}
+}
+
+static void
+dns_reply_addrs(struct mproc *p, uint64_t reqid, struct dns_addr *addrs,
+    size_t naddr)
+{
+	size_t	i;
+
+	for (i = 0; i < naddr; i++) {
+		m_create(p, IMSG_MTA_DNS_HOST, 0, 0, -1);
+		m_add_id(p, reqid);
+		m_add_sockaddr(p, (struct sockaddr *)&addrs[i].ss);
+		m_add_int(p, addrs[i].preference);
+		m_close(p);
+	}
+}
+
+static void
+dns_reply_end(struct mproc *p, uint64_t reqid, int error)
+{
+	m_create(p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
+	m_add_id(p, reqid);
+	m_add_int(p, error);
+	m_close(p);
+}
+
+/*
+ * Pass the addresses of finished host lookups to the waiters, so that
+ * the mta can start connecting before the slower ones are over.  The
+ * lookups are sorted by preference, and results are held back while
+ * a more preferred MX is still being resolved.
+ */
+static void
+dns_release(struct dns_session *s)
+{
+	struct dns_lookup	*l;
+	struct dns_waiter	*w;
+	int			 pending, preference;
+
+	pending = 0;
+	preference = 0;
+	TAILQ_FOREACH(l, &s->lookups, entry) {
+		if (!l->done) {
+			if (!pending) {
+				pending = 1;
+				preference = l->preference;
+			}
+			continue;
+		}
+		if (pending && l->preference > preference)
+			break;
+		if (l->sent)
+			continue;
+		l->sent = 1;
+		TAILQ_FOREACH(w, &s->waiters, entry)
+			dns_reply_addrs(w->p, w->reqid,
+			    s->answer.addrs + l->first, l->naddr);
+	}
+}
+
+static void
+dns_cache_insert(struct dns_session *s, time_t ttl)
+{
+	struct dns_entry	*e;
+
+	if ((e = dict_get(&dns_cache, s->key)) != NULL)
+		dns_cache_remove(e);
+
+	e = xcalloc(1, sizeof *e, "dns_cache_insert");
+	e->key = xstrdup(s->key, "dns_cache_insert");
+	e->type = s->type;
+	memmove(&e->ss, &s->ss, sizeof(e->ss));
+	e->ttl = ttl;
+	e->expire = time(NULL) + ttl;
+	e->answer = s->answer;
+	s->answer.addrs = NULL;
+	e->size = sizeof(*e) + strlen(e->key) + 1 +
+	    e->answer.naddr * sizeof(*e->answer.addrs);
+
+	dict_xset(&dns_cache, e->key, e);
+	TAILQ_INSERT_TAIL(&dns_lru, e, entry);
+	dns_cachesize += e->size;
+
+	while (dns_cachesize > DNS_CACHE_MEMORY)
+		dns_cache_remove(TAILQ_FIRST(&dns_lru));
+}
+
+static void
+dns_cache_remove(struct dns_entry *e)
+{
+	TAILQ_REMOVE(&dns_lru, e, entry);
+	dict_xpop(&dns_cache, e->key);
+	dns_cachesize -= e->size;
+
+	free(e->answer.addrs);
+	free(e->key);
+	free(e);
+}
+
+/*
+ * Find how long a negative answer may be cached, from the SOA record
+ * in the authority section.
+ */
+static uint32_t
+dns_negative_ttl(struct asr_result *ar)
+{
+	struct unpack		 pack;
+	struct dns_header	 h;
+	struct dns_query	 q;
+	struct dns_rr		 rr;
+
+	if (ar->ar_data == NULL)
+		return (0);
+
+	unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+	if (unpack_header(&pack, &h) == -1 || unpack_query(&pack, &q) == -1)
+		return (0);
+	for (; h.ancount; h.ancount--)
+		if (unpack_rr(&pack, &rr) == -1)
+			return (0);
+	for (; h.nscount; h.nscount--) {
+		if (unpack_rr(&pack, &rr) == -1)
+			return (0);
+		if (rr.rr_type == T_SOA)
+			return (rr.rr_ttl < rr.rr.soa.minimum ?
+			    rr.rr_ttl : rr.rr.soa.minimum);
+	}
+	return (0);
+}
+
 static void
 dns_dispatch_host(struct asr_result *ar, void *arg)
 {
 	struct dns_session	*s;
 	struct dns_lookup	*lookup = arg;
 	struct addrinfo		*ai;
+	struct dns_addr		*addr;
+	size_t			 n;
 
 	s = lookup->session;
-
-	for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next) {
-		s->mxfound++;
-		m_create(s->p, IMSG_MTA_DNS_HOST, 0, 0, -1);
-		m_add_id(s->p, s->reqid);
-		m_add_sockaddr(s->p, ai->ai_addr);
-		m_add_int(s->p, lookup->preference);
-		m_close(s->p);
+	lookup->eva = NULL;
+	evtimer_del(&lookup->ev);
+
+	lookup->first = s->answer.naddr;
+	n = 0;
+	for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next)
+		n++;
+	if (n) {
+		addr = reallocarray(s->answer.addrs, s->answer.naddr + n,
+		    sizeof(*s->answer.addrs));
+		if (addr == NULL)
+			fatal("dns_dispatch_host: reallocarray");
+		s->answer.addrs = addr;
+		for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next) {
+			addr = &s->answer.addrs[s->answer.naddr++];
+			memset(addr, 0, sizeof(*addr));
+			memmove(&addr->ss, ai->ai_addr, ai->ai_addrlen);
+			addr->preference = lookup->preference;
+		}
 	}
-	free(lookup);
+	lookup->naddr = n;
 	if (ar->ar_addrinfo)
 		asr_freeaddrinfo(ar->ar_addrinfo);
 
 	if (ar->ar_gai_errno)
 		s->error = ar->ar_gai_errno;
 
+	dns_host_done(lookup);
+}
+
+static void
+dns_timeout_host(int fd, short event, void *arg)
+{
+	struct dns_lookup	*lookup = arg;
+
+	log_debug("debug: dns: lookup timed out for %s",
+	    lookup->session->name);
+	stat_increment("dns.timeout", 1);
+
+	event_asr_abort(lookup->eva);
+	lookup->eva = NULL;
+
+	/* do not cache an answer that may be incomplete */
+	lookup->session->error = EAI_AGAIN;
+	dns_host_done(lookup);
+}
+
+static void
+dns_host_done(struct dns_lookup *lookup)
+{
+	struct dns_session	*s = lookup->session;
+
+	lookup->done = 1;
+	dns_release(s);
+
 	if (--s->refcount)
 		return;
 
-	m_create(s->p, IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-	m_add_id(s->p, s->reqid);
-	m_add_int(s->p, s->mxfound ? DNS_OK : DNS_ENOTFOUND);
-	m_close(s->p);
-	free(s);
+	if (s->answer.naddr)
+		s->answer.error = DNS_OK;
+	else if (s->error == EAI_AGAIN)
+		s->answer.error = DNS_RETRY;
+	else
+		s->answer.error = DNS_ENOTFOUND;
+	dns_done(s);
 }
 
 static void
@@ -332,13 +776,9 @@ dns_dispatch_ptr(struct asr_result *ar, void *arg)
 	struct dns_session	*s = arg;
 
 	/* The error code could be more precise, but we don't currently care */
-	m_create(s->p,  s->type, 0, 0, -1);
-	m_add_id(s->p, s->reqid);
-	m_add_int(s->p, ar->ar_gai_errno ? DNS_ENOTFOUND : DNS_OK);
-	if (ar->ar_gai_errno == 0)
-		m_add_string(s->p, s->name);
-	m_close(s->p);
-	free(s);
+	s->answer.error = ar->ar_gai_errno ? DNS_ENOTFOUND : DNS_OK;
+	s->error = ar->ar_gai_errno;
+	dns_done(s);
 }
 
 static void
@@ -353,18 +793,16 @@ dns_dispatch_mx(struct asr_result *ar, void *arg)
 	size_t			 found;
 
 	if (ar->ar_h_errno && ar->ar_h_errno != NO_DATA) {
-
-		m_create(s->p,  IMSG_MTA_DNS_HOST_END, 0, 0, -1);
-		m_add_id(s->p, s->reqid);
-		if (ar->ar_rcode == NXDOMAIN)
-			m_add_int(s->p, DNS_ENONAME);
+		if (ar->ar_rcode == NXDOMAIN) {
+			s->answer.error = DNS_ENONAME;
+			s->ttl = dns_negative_ttl(ar);
+		}
 		else if (ar->ar_h_errno == NO_RECOVERY)
-			m_add_int(s->p, DNS_EINVAL);
+			s->answer.error = DNS_EINVAL;
 		else
-			m_add_int(s->p, DNS_RETRY);
-		m_close(s->p);
-		free(s);
+			s->answer.error = DNS_RETRY;
 		free(ar->ar_data);
+		dns_done(s);
 		return;
 	}
 
@@ -380,6 +818,8 @@ dns_dispatch_mx(struct asr_result *ar, void *arg)
 		print_dname(rr.rr.mx.exchange, buf, sizeof(buf));
 		buf[strlen(buf) - 1] = '\0';
 		dns_lookup_host(s, buf, rr.rr.mx.preference);
+		if (s->ttl == 0 || rr.rr_ttl < s->ttl)
+			s->ttl = rr.rr_ttl ? rr.rr_ttl : 1;
 		found++;
 	}
 	free(ar->ar_data);
@@ -441,8 +881,9 @@ dns_dispatch_mx_preference(struct asr_result *ar, void *arg)
 static void
 dns_lookup_host(struct dns_session *s, const char *host, int preference)
 {
-	struct dns_lookup	*lookup;
+	struct dns_lookup	*lookup, *l;
 	struct addrinfo		 hints;
+	struct timeval		 tv;
 	char			 hostcopy[HOST_NAME_MAX+1];
 	char			*p;
 	void			*as;
@@ -452,6 +893,14 @@ dns_lookup_host(struct dns_session *s, const char *host, int preference)
 	lookup->session = s;
 	s->refcount++;
 
+	TAILQ_FOREACH(l, &s->lookups, entry)
+		if (l->preference > preference)
+			break;
+	if (l)
+		TAILQ_INSERT_BEFORE(l, lookup, entry);
+	else
+		TAILQ_INSERT_TAIL(&s->lookups, lookup, entry);
+
 	if (*host == '[') {
 		if (strncasecmp("[IPv6:", host, 6) == 0)
 			host += 6;
@@ -469,7 +918,12 @@ dns_lookup_host(struct dns_session *s, const char *host, int preference)
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	as = getaddrinfo_async(host, NULL, &hints, NULL);
-	event_asr_run(as, dns_dispatch_host, lookup);
+	lookup->eva = event_asr_run(as, dns_dispatch_host, lookup);
+
+	evtimer_set(&lookup->ev, dns_timeout_host, lookup);
+	tv.tv_sec = DNS_HOST_TIMEOUT;
+	tv.tv_usec = 0;
+	evtimer_add(&lookup->ev, &tv);
 }
 
 static char *
@@ -38,6 +38,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "smtpd.h"
@@ -49,6 +50,16 @@ enum {
 	QUERY_DONE
 };
 
+#define FILTER_CACHE_MAX	4096
+
+struct filter_verdict {
+	TAILQ_ENTRY(filter_verdict)	 entry;
+	char				*key;
+	time_t				 expire;
+	int				 status;
+	int				 code;
+	char				*response;
+};
 
 struct filter_proc {
 	TAILQ_ENTRY(filter_proc)	 entry;
@@ -56,6 +67,12 @@ struct filter_proc {
 	int				 hooks;
 	int				 flags;
 	int				 ready;
+	int				 parallel;
+
+	time_t				 cachettl;
+	struct dict			 cache;
+	TAILQ_HEAD(, filter_verdict)	 verdicts;
+	size_t				 nverdicts;
 };
 
 struct filter {
@@ -68,6 +85,7 @@ TAILQ_HEAD(filter_query_lst, filter_query);
 struct filter_session {
 	uint64_t		 id;
 	int			 terminate;
+	struct sockaddr_storage	 ss;
 	struct filter_lst	*filters;
 	struct filter		*fcurr;
 
@@ -88,6 +106,11 @@ struct filter_query {
 	int				 state;
 	struct filter			*current;
 
+	/* filters running the query, from current up to next */
+	struct filter			*next;
+	size_t				 pending;
+	struct filter_proc		*rejectby;
+
 	/* current data */
 	union {
 		struct {
@@ -112,7 +135,21 @@ static void filter_imsg(struct mproc *, struct imsg *);
 static void filter_post_event(uint64_t, int, struct filter *, struct filter *);
 static struct filter_query *filter_query(struct filter_session *, int);
 static void filter_drain_query(struct filter_query *);
+static int filter_hooked(struct filter *, int);
+static int filter_parallel(struct filter *, int);
+static int filter_precedes(struct filter_query *, struct filter_proc *,
+    struct filter_proc *);
 static void filter_run_query(struct filter *, struct filter_query *);
+static void filter_send_query(struct filter *, struct filter_query *);
+static void filter_call_query(struct filter *, struct filter_query *);
+static void filter_result(struct filter_query *, struct filter_proc *, int,
+    int, const char *);
+static const char *filter_cache_key(struct filter_query *);
+static struct filter_verdict *filter_cache_lookup(struct filter_proc *,
+    struct filter_query *);
+static void filter_cache_store(struct filter_proc *, struct filter_query *,
+    int, int, const char *);
+static void filter_cache_evict(struct filter_proc *, struct filter_verdict *);
 static void filter_end_query(struct filter_query *);
 static void filter_set_sink(struct filter_session *, int);
 static int filter_tx(struct filter_session *, int);
@@ -200,6 +237,10 @@ filter_postfork(void)
 		p->proc = PROC_FILTER;
 		p->name = xstrdup(filter->name, "filter_postfork");
 		p->data = proc;
+		proc->parallel = filter->parallel;
+		proc->cachettl = filter->cachettl;
+		dict_init(&proc->cache);
+		TAILQ_INIT(&proc->verdicts);
 		if (verbose & TRACE_DEBUG)
 			filter_add_arg(filter, "-v");
 		if (foreground_log)
@@ -317,6 +358,7 @@ filter_connect(uint64_t id, const struct sockaddr *local,
 	if (filter == NULL)
 		filter = "<no-filter>";
 	s->filters = dict_xget(&chains, filter);
+	memmove(&s->ss, remote, SA_LEN(remote));
 	io_init(&s->iev, NULL);
 	tree_xset(&sessions, s->id, s);
 
@@ -456,7 +498,12 @@ filter_drain_query(struct filter_query *q)
 	 */
 	while (q->state != QUERY_DONE) {
 		/* Walk over all filters */
-		while (q->current) {
+		while (q->current && q->state != QUERY_DONE) {
+			/* filters are not asked what they did not hook */
+			if (!filter_hooked(q->current, q->type)) {
+				q->current = TAILQ_NEXT(q->current, entry);
+				continue;
+			}
 			filter_run_query(q->current, q);
 			if (q->state == QUERY_RUNNING) {
 				log_trace(TRACE_FILTERS,
@@ -478,8 +525,258 @@ filter_drain_query(struct filter_query *q)
 	filter_end_query(q);
 }
 
+/*
+ * Tell whether a filter registered a hook for the given query type.
+ * Filters rewriting the data take part in DATA and EOM, since the
+ * latter carries the size of their output.
+ */
+static int
+filter_hooked(struct filter *f, int type)
+{
+	int	hooks;
+
+	switch (type) {
+	case QUERY_CONNECT:
+		hooks = HOOK_CONNECT;
+		break;
+	case QUERY_HELO:
+		hooks = HOOK_HELO;
+		break;
+	case QUERY_MAIL:
+		hooks = HOOK_MAIL;
+		break;
+	case QUERY_RCPT:
+		hooks = HOOK_RCPT;
+		break;
+	case QUERY_DATA:
+		hooks = HOOK_DATA | HOOK_DATALINE;
+		break;
+	case QUERY_EOM:
+		hooks = HOOK_EOM | HOOK_DATALINE;
+		break;
+	default:
+		return (1);
+	}
+
+	return (f->proc->hooks & hooks);
+}
+
+/*
+ * Tell whether a filter may run a query alongside its neighbours.  A
+ * filter rewriting the data must see the size of its input at EOM,
+ * which depends on the filters before it.
+ */
+static int
+filter_parallel(struct filter *f, int type)
+{
+	if (!f->proc->parallel)
+		return (0);
+	if (type == QUERY_EOM && (f->proc->hooks & HOOK_DATALINE))
+		return (0);
+	return (1);
+}
+
+/*
+ * Tell whether filter a comes before filter b among those running
+ * the query.
+ */
+static int
+filter_precedes(struct filter_query *q, struct filter_proc *a,
+    struct filter_proc *b)
+{
+	struct filter	*f;
+
+	for (f = q->current; f; f = TAILQ_NEXT(f, entry)) {
+		if (f->proc == a)
+			return (1);
+		if (f->proc == b)
+			return (0);
+	}
+	return (0);
+}
+
+/*
+ * Run the query on the given filter.  If it is parallel, the query is
+ * also sent to all the parallel filters following it, and the
+ * verdicts are combined when the last one answers.
+ */
 static void
 filter_run_query(struct filter *f, struct filter_query *q)
+{
+	q->pending = 0;
+	q->rejectby = NULL;
+
+	q->next = TAILQ_NEXT(f, entry);
+	filter_call_query(f, q);
+	if (filter_parallel(f, q->type)) {
+		for (; q->next; q->next = TAILQ_NEXT(q->next, entry)) {
+			if (!filter_hooked(q->next, q->type))
+				continue;
+			if (!filter_parallel(q->next, q->type))
+				break;
+			filter_call_query(q->next, q);
+		}
+	}
+
+	if (q->pending) {
+		tree_xset(&queries, q->qid, q);
+		q->state = QUERY_RUNNING;
+		return;
+	}
+
+	/* all verdicts were cached */
+	q->state = (q->smtp.status == FILTER_OK) ? QUERY_READY : QUERY_DONE;
+	q->current = q->next;
+}
+
+static void
+filter_call_query(struct filter *f, struct filter_query *q)
+{
+	struct filter_verdict	*v;
+
+	if ((v = filter_cache_lookup(f->proc, q)) != NULL) {
+		log_trace(TRACE_FILTERS,
+		    "filter: cached verdict from %s for query %s",
+		    filter_to_text(f), filter_query_to_text(q));
+		filter_result(q, f->proc, v->status, v->code, v->response);
+		return;
+	}
+
+	filter_send_query(f, q);
+	q->pending++;
+}
+
+/*
+ * Record the verdict of a filter.  Among parallel filters, the first
+ * one in the chain to reject has the last word.
+ */
+static void
+filter_result(struct filter_query *q, struct filter_proc *proc, int status,
+    int code, const char *line)
+{
+	if (q->smtp.status != FILTER_OK && (status == FILTER_OK ||
+	    !filter_precedes(q, proc, q->rejectby)))
+		return;
+
+	q->smtp.status = status;
+	if (code)
+		q->smtp.code = code;
+	if (line) {
+		free(q->smtp.response);
+		q->smtp.response = xstrdup(line, "filter_result");
+	}
+	if (status != FILTER_OK)
+		q->rejectby = proc;
+}
+
+/*
+ * Build the cache key of a query.  Only the queries answered before
+ * DATA are cached, and always along with the client address.
+ */
+static const char *
+filter_cache_key(struct filter_query *q)
+{
+	static char	 buf[LINE_MAX];
+	char		 addr[NI_MAXHOST + 5];
+	int		 n;
+
+	(void)strlcpy(addr, ss_to_text(&q->session->ss), sizeof addr);
+
+	switch (q->type) {
+	case QUERY_CONNECT:
+		n = snprintf(buf, sizeof buf, "%d|%s|%s|", q->type, addr,
+		    q->u.connect.hostname);
+		if (n < 0 || (size_t)n >= sizeof buf)
+			return (NULL);
+		if (strlcat(buf, ss_to_text(&q->u.connect.local), sizeof buf)
+		    >= sizeof buf)
+			return (NULL);
+		break;
+	case QUERY_HELO:
+		n = snprintf(buf, sizeof buf, "%d|%s|%s", q->type, addr,
+		    q->u.line);
+		break;
+	case QUERY_MAIL:
+		n = snprintf(buf, sizeof buf, "%d|%s|%s@%s", q->type, addr,
+		    q->u.maddr.user, q->u.maddr.domain);
+		break;
+	default:
+		return (NULL);
+	}
+
+	/* a truncated key could match another query: do not cache */
+	if (n < 0 || (size_t)n >= sizeof buf)
+		return (NULL);
+
+	return (buf);
+}
+
+static struct filter_verdict *
+filter_cache_lookup(struct filter_proc *proc, struct filter_query *q)
+{
+	struct filter_verdict	*v;
+	const char		*key;
+	time_t			 now;
+
+	if (proc->cachettl == 0 || (key = filter_cache_key(q)) == NULL)
+		return (NULL);
+
+	/* entries expire in the order they were added */
+	now = time(NULL);
+	while ((v = TAILQ_FIRST(&proc->verdicts)) && v->expire <= now)
+		filter_cache_evict(proc, v);
+
+	if ((v = dict_get(&proc->cache, key)) == NULL) {
+		stat_increment("filter.cache.miss", 1);
+		return (NULL);
+	}
+
+	stat_increment("filter.cache.hit", 1);
+	return (v);
+}
+
+static void
+filter_cache_store(struct filter_proc *proc, struct filter_query *q,
+    int status, int code, const char *line)
+{
+	struct filter_verdict	*v;
+	const char		*key;
+
+	if (proc->cachettl == 0 || (key = filter_cache_key(q)) == NULL)
+		return;
+
+	if ((v = dict_get(&proc->cache, key)) != NULL)
+		filter_cache_evict(proc, v);
+	else if (proc->nverdicts == FILTER_CACHE_MAX)
+		filter_cache_evict(proc, TAILQ_FIRST(&proc->verdicts));
+
+	v = xcalloc(1, sizeof(*v), "filter_cache_store");
+	v->key = xstrdup(key, "filter_cache_store");
+	v->expire = time(NULL) + proc->cachettl;
+	v->status = status;
+	v->code = code;
+	if (line)
+		v->response = xstrdup(line, "filter_cache_store");
+
+	dict_xset(&proc->cache, v->key, v);
+	TAILQ_INSERT_TAIL(&proc->verdicts, v, entry);
+	proc->nverdicts++;
+}
+
+static void
+filter_cache_evict(struct filter_proc *proc, struct filter_verdict *v)
+{
+	TAILQ_REMOVE(&proc->verdicts, v, entry);
+	dict_xpop(&proc->cache, v->key);
+	proc->nverdicts--;
+
+	free(v->key);
+	free(v->response);
+	free(v);
+}
+
+static void
+filter_send_query(struct filter *f, struct filter_query *q)
 {
 	log_trace(TRACE_FILTERS,
 	    "filter: running filter %s for query %s",
@@ -512,9 +809,6 @@ filter_run_query(struct filter *f, struct filter_query *q)
 		break;
 	}
 	m_close(&f->proc->mproc);
-
-	tree_xset(&queries, q->qid, q);
-	q->state = QUERY_RUNNING;
 }
 
 static void
@@ -611,24 +905,24 @@ filter_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_string(&m, &line);
 		m_end(&m);
 
-		q = tree_xpop(&queries, qid);
+		q = tree_xget(&queries, qid);
 		if (q->type != type) {
 			log_warnx("warn: filter: type mismatch %d != %d",
 			    q->type, type);
 			fatalx("exiting");
 		}
-		q->smtp.status = status;
-		if (code)
-			q->smtp.code = code;
-		if (line) {
-			free(q->smtp.response);
-			q->smtp.response = xstrdup(line, "filter_imsg");
-		}
-		q->state = (status == FILTER_OK) ? QUERY_READY : QUERY_DONE;
+
+		filter_cache_store(proc, q, status, code, line);
+		filter_result(q, proc, status, code, line);
 		if (type == QUERY_EOM)
 			q->u.datalen = datalen;
 
-		q->current = TAILQ_NEXT(q->current, entry);
+		if (--q->pending)
+			break;
+		tree_xpop(&queries, qid);
+
+		q->state = (q->smtp.status == FILTER_OK) ? QUERY_READY : QUERY_DONE;
+		q->current = q->next;
 		filter_drain_query(q);
 		break;
 
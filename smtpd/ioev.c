@@ -60,6 +60,7 @@ void	io_dispatch_connect(int, short, void *);
 size_t	io_pending(struct io *);
 size_t	io_queued(struct io*);
 void	io_reset(struct io *, short, void (*)(int, short, void*));
+int	io_registered(struct io *, short, void (*)(int, short, void*));
 void	io_frame_enter(const char *, struct io *, int);
 void	io_frame_leave(struct io *);
 
@@ -539,17 +540,30 @@ io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 	 */
 	io->flags |= IO_RESET;
 
-	if (event_initialized(&io->ev))
-		event_del(&io->ev);
-
 	/*
 	 * The io is paused by the user, so we don't want the timeout to be
 	 * effective.
 	 */
-	if (events == 0)
+	if (events == 0) {
+		if (event_initialized(&io->ev))
+			event_del(&io->ev);
 		return;
+	}
+
+	/*
+	 * Events are persistent.  If the very same events and handler are
+	 * still registered for this socket, there is no need to go through
+	 * a del/set/add cycle, which costs two syscalls with the epoll and
+	 * kqueue backends: re-adding the event only refreshes the timeout.
+	 */
+	if (!io_registered(io, events, dispatch)) {
+		if (event_initialized(&io->ev))
+			event_del(&io->ev);
+		event_set(&io->ev, io->sock, events | EV_PERSIST, dispatch, io);
+		io->evmask = events;
+		io->evdispatch = dispatch;
+	}
 
-	event_set(&io->ev, io->sock, events, dispatch, io);
 	if (io->timeout >= 0) {
 		tv.tv_sec = io->timeout / 1000;
 		tv.tv_usec = (io->timeout % 1000) * 1000;
@@ -560,6 +574,20 @@ io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 	event_add(&io->ev, ptv);
 }
 
+/* Check whether the given events and handler are currently registered. */
+int
+io_registered(struct io *io, short events, void (*dispatch)(int, short, void*))
+{
+	if (!event_initialized(&io->ev))
+		return (0);
+	if (!event_pending(&io->ev, EV_READ|EV_WRITE, NULL))
+		return (0);
+
+	return (EVENT_FD(&io->ev) == io->sock &&
+	    io->evmask == events &&
+	    io->evdispatch == dispatch);
+}
+
 size_t
 io_pending(struct io *io)
 {
@@ -755,6 +783,9 @@ io_dispatch_connect(int fd, short ev, void *humppa)
 
 	io_frame_enter("io_dispatch_connect", io, ev);
 
+	/* the connect event is persistent, drop it before closing the fd */
+	event_del(&io->ev);
+
 	if (ev == EV_TIMEOUT) {
 		close(fd);
 		io->sock = -1;
@@ -1024,8 +1055,11 @@ io_reload_ssl(struct io *io)
 			ev = EV_WRITE;
 			dispatch = io_dispatch_write_ssl;
 		}
-		if (!ev)
-			return; /* paused */
+		if (!ev) {
+			/* paused: drop the persistent event */
+			io_reset(io, 0, NULL);
+			return;
+		}
 		break;
 	default:
 		errx(1, "io_reload_ssl(): bad state");
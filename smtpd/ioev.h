@@ -47,6 +47,8 @@ struct io {
 	int		 flags;
 	int		 state;
 	struct event	 ev;
+	short		 evmask;	/* events registered on ev */
+	void		(*evdispatch)(int, short, void *);
 	void		*ssl;
 	const char	*error; /* only valid immediately on callback */
 };
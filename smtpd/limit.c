@@ -62,10 +62,13 @@ limit_mta_set_defaults(struct mta_limits *limits)
 	limits->max_failures_per_session = 25;
 
 	limits->family = AF_UNSPEC;
+	limits->adaptive = 0;
 
 	limits->task_hiwat = 50;
 	limits->task_lowat = 30;
 	limits->task_release = 10;
+	limits->task_coalesce = 0;
+	limits->task_max_rcpt = 100;
 }
 
 int
@@ -110,12 +113,19 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 	else if (!strcmp(key, "max-failures-per-session"))
 		limits->max_failures_per_session = value;
 
+	else if (!strcmp(key, "adaptive"))
+		limits->adaptive = value ? 1 : 0;
+
 	else if (!strcmp(key, "task-hiwat"))
 		limits->task_hiwat = value;
 	else if (!strcmp(key, "task-lowat"))
 		limits->task_lowat = value;
 	else if (!strcmp(key, "task-release"))
 		limits->task_release = value;
+	else if (!strcmp(key, "task-coalesce-delay"))
+		limits->task_coalesce = value;
+	else if (!strcmp(key, "task-max-rcpt"))
+		limits->task_max_rcpt = value;
 
 	else
 		return (0);
@@ -71,7 +71,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	int			 ret;
 	struct pki		*pki;
 	struct iovec		iov[2];
-	static struct ca_vrfy_req_msg	*req_ca_vrfy = NULL;
+	struct ca_vrfy_req_msg		*req_ca_vrfy;
 	struct ca_vrfy_req_msg		*req_ca_vrfy_chain;
 	struct ca_cert_req_msg		*req_ca_cert;
 	struct ca_cert_resp_msg		 resp_ca_cert;
@@ -85,7 +85,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	char			 buf[LINE_MAX];
 	const char		*tablename, *username, *password, *label;
 	uint64_t		 reqid;
-	int			 v;
+	int			 i, v;
 
 	if (imsg == NULL)
 		lka_shutdown();
@@ -172,6 +172,10 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 
 		case IMSG_SMTP_TLS_VERIFY_CERT:
 		case IMSG_MTA_TLS_VERIFY_CERT:
+			/*
+			 * The request is sent in several parts, keep it on
+			 * the peer since pony workers may interleave them.
+			 */
 			req_ca_vrfy = xmemdup(imsg->data, sizeof *req_ca_vrfy, "lka:ca_vrfy");
 			req_ca_vrfy->cert = xmemdup((char *)imsg->data +
 			    sizeof *req_ca_vrfy, req_ca_vrfy->cert_len, "lka:ca_vrfy");
@@ -179,10 +183,12 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			    sizeof (unsigned char *), "lka:ca_vrfy");
 			req_ca_vrfy->chain_cert_len = xcalloc(req_ca_vrfy->n_chain,
 			    sizeof (off_t), "lka:ca_vrfy");
+			p->data = req_ca_vrfy;
 			return;
 
 		case IMSG_SMTP_TLS_VERIFY_CHAIN:
 		case IMSG_MTA_TLS_VERIFY_CHAIN:
+			req_ca_vrfy = p->data;
 			if (req_ca_vrfy == NULL)
 				fatalx("lka:ca_vrfy: chain without a certificate");
 			req_ca_vrfy_chain = imsg->data;
@@ -194,10 +200,11 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 
 		case IMSG_SMTP_TLS_VERIFY:
 		case IMSG_MTA_TLS_VERIFY:
+			req_ca_vrfy = p->data;
 			if (req_ca_vrfy == NULL)
 				fatalx("lka:ca_vrfy: verify without a certificate");
 			lka_certificate_verify(imsg->hdr.type, req_ca_vrfy);
-			req_ca_vrfy = NULL;
+			p->data = NULL;
 			return;
 
 		case IMSG_SMTP_AUTHENTICATE:
@@ -337,7 +344,8 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 				err(1, "pledge");
 
 			/* Start fulfilling requests */
-			mproc_enable(p_pony);
+			for (i = 0; i < env->sc_pony_workers; i++)
+				mproc_enable(p_ponies[i]);
 			return;
 
 		case IMSG_LKA_OPEN_FORWARD:
@@ -345,8 +353,10 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 
 		case IMSG_LKA_AUTHENTICATE:
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
 			imsg->hdr.type = IMSG_SMTP_AUTHENTICATE;
-			m_forward(p_pony, imsg);
+			m_forward(pony_by_id(reqid), imsg);
 			return;
 		}
 	}
@@ -412,6 +422,7 @@ lka(void)
 {
 	struct passwd	*pw;
 	struct event	 ev_sigchld;
+	int		 i;
 
 	purge_config(PURGE_LISTENERS);
 
@@ -441,7 +452,8 @@ lka(void)
 	config_peer(PROC_PONY);
 
 	/* Ignore them until we get our config */
-	mproc_disable(p_pony);
+	for (i = 0; i < env->sc_pony_workers; i++)
+		mproc_disable(p_ponies[i]);
 
 	/* proc & exec will be revoked before serving requests */
 	if (pledge("stdio rpath inet dns getpw recvfd proc exec", NULL) == -1)
@@ -699,7 +711,7 @@ lka_certificate_verify_resume(enum imsg_type type, struct ca_vrfy_req_msg *req)
 	else
 		resp.status = CA_OK;
 
-	m_compose(p_pony, type, 0, 0, -1, &resp,
+	m_compose(pony_by_id(resp.reqid), type, 0, 0, -1, &resp,
 	    sizeof resp);
 
 	for (i = 0; i < req->n_chain; ++i)
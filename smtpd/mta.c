@@ -43,6 +43,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <openssl/ssl.h>
+
 #include "smtpd.h"
 #include "log.h"
 
@@ -57,6 +59,12 @@
 #define DELAY_ROUTE_BASE	15
 #define DELAY_ROUTE_MAX		3600
 
+#define AIMD_WINDOW_INIT	2
+#define AIMD_SLOW		10000	/* ms, slower transactions do not count */
+
+#define STATS_MAX		10000
+#define STATS_SYNC_DELAY	60
+
 #define RELAY_ONHOLD		0x01
 #define RELAY_HOLDQ		0x02
 
@@ -69,10 +77,19 @@ static void mta_on_secret(struct mta_relay *, const char *);
 static void mta_on_preference(struct mta_relay *, int);
 static void mta_on_source(struct mta_relay *, struct mta_source *);
 static void mta_on_timeout(struct runq *, void *);
-static void mta_connect(struct mta_connector *);
+static void mta_connect(struct mta_connector *, int);
+static int mta_reuse(struct mta_connector *);
+static size_t mta_maxconn(struct mta_limits *, struct mta_aimd *, size_t);
+static void mta_aimd_update(struct mta_aimd *, size_t, int);
+static struct mta_stats *mta_stats(const char *, const char *, int);
+static void mta_stats_update(struct mta_stats *, const char *, int);
+static void mta_stats_load(struct mta_stats *);
+static int mta_stats_percentile(struct mta_stats *, int);
+static void mta_stats_sync(int, short, void *);
 static void mta_route_enable(struct mta_route *);
 static void mta_route_disable(struct mta_route *, int, int);
 static void mta_drain(struct mta_relay *);
+static struct mta_task *mta_task_ready(struct mta_relay *, time_t *);
 static void mta_delivery_flush_event(int, short, void *);
 static void mta_flush(struct mta_relay *, int, const char *);
 static struct mta_route *mta_find_route(struct mta_connector *, time_t, int*,
@@ -145,6 +162,12 @@ static struct mta_source_tree		sources;
 static struct mta_route_tree		routes;
 static struct mta_block_tree		blocks;
 
+/*
+ * Bumped whenever the state mta_find_route() depends on changes, so
+ * that connectors do not scan their MXs again for the same answer.
+ */
+static uint64_t routegen = 1;
+
 static struct tree wait_mx;
 static struct tree wait_preference;
 static struct tree wait_secret;
@@ -156,6 +179,7 @@ static struct runq *runq_relay;
 static struct runq *runq_connector;
 static struct runq *runq_route;
 static struct runq *runq_hoststat;
+static struct runq *runq_coalesce;
 
 static time_t	max_seen_conndelay_route;
 static time_t	max_seen_discdelay_route;
@@ -169,6 +193,11 @@ struct hoststat {
 };
 static struct dict hoststat;
 
+static struct dict hoststats;
+static struct dict hoststats_dirty;
+static struct dict hoststats_sent;
+static struct event ev_hoststats;
+
 void mta_hoststat_update(const char *, const char *);
 void mta_hoststat_cache(const char *, uint64_t);
 void mta_hoststat_uncache(const char *, uint64_t);
@@ -188,6 +217,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 	struct mta_mx		*mx, *imx;
 	struct mta_source	*source;
 	struct hoststat		*hs;
+	struct mta_stats	*st;
 	struct mta_envelope	*e;
 	struct sockaddr_storage	 ss;
 	struct envelope		 evp;
@@ -205,6 +235,13 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 	if (p->proc == PROC_QUEUE) {
 		switch (imsg->hdr.type) {
 
+		case IMSG_MTA_HOSTSTATS:
+			if (imsg->hdr.len - IMSG_HEADER_SIZE !=
+			    sizeof(struct mta_stats))
+				fatalx("mta_imsg: bad hoststats size");
+			mta_stats_load(imsg->data);
+			return;
+
 		case IMSG_QUEUE_TRANSFER:
 			m_msg(&m, imsg);
 			m_get_envelope(&m, &evp);
@@ -235,14 +272,23 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				return;
 			}
 
+			/*
+			 * Envelopes for the same message are grouped in a
+			 * single transaction, up to the recipient limit.
+			 */
 			task = NULL;
 			TAILQ_FOREACH(task, &relay->tasks, entry)
-				if (task->msgid == evpid_to_msgid(evp.id))
+				if (task->msgid == evpid_to_msgid(evp.id) &&
+				    (relay->limits == NULL ||
+				    relay->limits->task_max_rcpt == 0 ||
+				    task->nenvelope < relay->limits->task_max_rcpt))
 					break;
 
 			if (task == NULL) {
 				task = xmalloc(sizeof *task, "mta_task");
 				TAILQ_INIT(&task->envelopes);
+				task->nenvelope = 0;
+				task->creation = time(NULL);
 				task->relay = relay;
 				relay->ntask += 1;
 				TAILQ_INSERT_TAIL(&relay->tasks, task, entry);
@@ -279,6 +325,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			e->dsn_ret = evp.dsn_ret;
 
 			TAILQ_INSERT_TAIL(&task->envelopes, e, entry);
+			task->nenvelope += 1;
 			log_debug("debug: mta: received evp:%016" PRIx64
 			    " for <%s>", e->id, e->dest);
 
@@ -333,13 +380,27 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			mx = xcalloc(1, sizeof *mx, "mta: mx");
 			mx->host = mta_host((struct sockaddr*)&ss);
 			mx->preference = preference;
-			TAILQ_FOREACH(imx, &domain->mxs, entry) {
-				if (imx->preference > mx->preference) {
-					TAILQ_INSERT_BEFORE(imx, mx, entry);
-					return;
-				}
+			TAILQ_FOREACH(imx, &domain->mxs, entry)
+				if (imx->preference > mx->preference)
+					break;
+			if (imx)
+				TAILQ_INSERT_BEFORE(imx, mx, entry);
+			else
+				TAILQ_INSERT_TAIL(&domain->mxs, mx, entry);
+			routegen++;
+
+			/*
+			 * Addresses come as soon as they are resolved, best
+			 * MXs first: start delivering with what we have.
+			 */
+			if (domain->lastmxquery == 0) {
+				log_debug("debug: mta: first MX for domain %s",
+				    domain->name);
+				domain->mxstatus = DNS_OK;
+				domain->mxpending = 1;
+				domain->lastmxquery = time(NULL);
+				waitq_run(&domain->mxs, domain);
 			}
-			TAILQ_INSERT_TAIL(&domain->mxs, mx, entry);
 			return;
 
 		case IMSG_MTA_DNS_HOST_END:
@@ -348,6 +409,15 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_int(&m, &dnserror);
 			m_end(&m);
 			domain = tree_xpop(&wait_mx, reqid);
+			if (domain->mxpending) {
+				/* relays are already running */
+				domain->mxpending = 0;
+				routegen++;
+				log_debug("debug: mta: MX lookup over for "
+				    "domain %s (status %d)", domain->name,
+				    dnserror);
+				return;
+			}
 			domain->mxstatus = dnserror;
 			if (domain->mxstatus == DNS_OK) {
 				log_debug("debug: MXs for domain %s:",
@@ -362,6 +432,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				    domain->name);
 			}
 			domain->lastmxquery = time(NULL);
+			routegen++;
 			waitq_run(&domain->mxs, domain);
 			return;
 
@@ -440,12 +511,14 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 					route->flags |= ROUTE_NEW;
 					route->nerror = 0;
 					route->penalty = 0;
+					routegen++;
 					mta_route_unref(route); /* from mta_route_disable */
 				}
 
 				if (u64)
 					break;
 			}
+			m_compose(p, IMSG_CTL_OK, imsg->hdr.peerid, 0, -1, NULL, 0);
 			return;
 
 		case IMSG_CTL_MTA_SHOW_HOSTS:
@@ -458,6 +531,17 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				    host->refcount,
 				    host->nconn,
 				    host->lastconn ? duration_to_text(t - host->lastconn) : "-");
+				st = mta_stats("host", sa_to_text(host->sa), 0);
+				if (st)
+					(void)snprintf(buf + strlen(buf),
+					    sizeof(buf) - strlen(buf),
+					    " ok=%llu tempfail=%llu permfail=%llu"
+					    " p50=%dms p95=%dms",
+					    (unsigned long long)st->ok,
+					    (unsigned long long)st->tempfail,
+					    (unsigned long long)st->permfail,
+					    mta_stats_percentile(st, 50),
+					    mta_stats_percentile(st, 95));
 				m_compose(p, IMSG_CTL_MTA_SHOW_HOSTS,
 				    imsg->hdr.peerid, 0, -1,
 				    buf, strlen(buf) + 1);
@@ -478,7 +562,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			SPLAY_FOREACH(route, mta_route_tree, &routes) {
 				v = runq_pending(runq_route, NULL, route, &t);
 				(void)snprintf(buf, sizeof(buf),
-				    "%llu. %s %c%c%c%c nconn=%zu nerror=%d penalty=%d timeout=%s",
+				    "%llu. %s %c%c%c%c nconn=%zu window=%zu nerror=%d penalty=%d timeout=%s",
 				    (unsigned long long)route->id,
 				    mta_route_to_text(route),
 				    route->flags & ROUTE_NEW ? 'N' : '-',
@@ -486,6 +570,7 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				    route->flags & ROUTE_RUNQ ? 'Q' : '-',
 				    route->flags & ROUTE_KEEPALIVE ? 'K' : '-',
 				    route->nconn,
+				    route->dst->aimd.window,
 				    route->nerror,
 				    route->penalty,
 				    v ? duration_to_text(t - time(NULL)) : "-");
@@ -520,13 +605,14 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_string(&m, &dom);
 			m_end(&m);
 			source = mta_source((struct sockaddr*)&ss);
-			if (*dom != '\0') {
-				if (!(strlcpy(buf, dom, sizeof(buf))
-					>= sizeof(buf)))
-					mta_block(source, buf);
+			if (*dom != '\0' &&
+			    strlcpy(buf, dom, sizeof(buf)) >= sizeof(buf)) {
+				mta_source_unref(source);
+				m_compose(p, IMSG_CTL_FAIL, imsg->hdr.peerid,
+				    0, -1, NULL, 0);
+				return;
 			}
-			else
-				mta_block(source, NULL);
+			mta_block(source, *dom != '\0' ? buf : NULL);
 			mta_source_unref(source);
 			m_compose(p, IMSG_CTL_OK, imsg->hdr.peerid, 0, -1, NULL, 0);
 			return;
@@ -537,13 +623,14 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_string(&m, &dom);
 			m_end(&m);
 			source = mta_source((struct sockaddr*)&ss);
-			if (*dom != '\0') {
-				if (!(strlcpy(buf, dom, sizeof(buf))
-					>= sizeof(buf)))
-					mta_unblock(source, buf);
+			if (*dom != '\0' &&
+			    strlcpy(buf, dom, sizeof(buf)) >= sizeof(buf)) {
+				mta_source_unref(source);
+				m_compose(p, IMSG_CTL_FAIL, imsg->hdr.peerid,
+				    0, -1, NULL, 0);
+				return;
 			}
-			else
-				mta_unblock(source, NULL);
+			mta_unblock(source, *dom != '\0' ? buf : NULL);
 			mta_source_unref(source);
 			m_compose(p, IMSG_CTL_OK, imsg->hdr.peerid, 0, -1, NULL, 0);
 			return;
@@ -586,6 +673,11 @@ mta_postprivdrop(void)
 	tree_init(&wait_source);
 	tree_init(&flush_evp);
 	dict_init(&hoststat);
+	dict_init(&hoststats);
+	dict_init(&hoststats_dirty);
+	dict_init(&hoststats_sent);
+
+	evtimer_set(&ev_hoststats, mta_stats_sync, NULL);
 
 	evtimer_set(&ev_flush_evp, mta_delivery_flush_event, NULL);
 
@@ -593,6 +685,7 @@ mta_postprivdrop(void)
 	runq_init(&runq_connector, mta_on_timeout);
 	runq_init(&runq_route, mta_on_timeout);
 	runq_init(&runq_hoststat, mta_on_timeout);
+	runq_init(&runq_coalesce, mta_on_timeout);
 }
 
 
@@ -641,9 +734,10 @@ mta_route_ok(struct mta_relay *relay, struct mta_route *route)
 
 	route->nerror = 0;
 	route->flags &= ~ROUTE_NEW;
+	routegen++;
 
 	c = mta_connector(relay, route->src);
-	mta_connect(c);
+	mta_connect(c, 0);
 }
 
 void
@@ -654,6 +748,323 @@ mta_route_down(struct mta_relay *relay, struct mta_route *route)
 #endif
 }
 
+/*
+ * A connection attempt on the route is taking too long: allow one more
+ * attempt on another route to run alongside it.
+ */
+void
+mta_route_stalled(struct mta_relay *relay, struct mta_route *route)
+{
+	struct mta_connector	*c;
+
+	log_debug("debug: mta-routing: connection on %s stalled",
+	    mta_route_to_text(route));
+
+	stat_increment("mta.connect.fallback", 1);
+	route->flags |= ROUTE_STALLED;
+	routegen++;
+
+	c = mta_connector(relay, route->src);
+	mta_connect(c, 1);
+}
+
+void
+mta_route_connected(struct mta_relay *relay, struct mta_route *route)
+{
+	route->flags &= ~ROUTE_STALLED;
+	routegen++;
+}
+
+/*
+ * The connection attempt lost the race against another route.
+ */
+void
+mta_route_cancel(struct mta_relay *relay, struct mta_route *route)
+{
+	route->flags |= ROUTE_CANCEL;
+}
+
+/*
+ * An idle session on the route is taken over by another relay.
+ */
+void
+mta_route_handoff(struct mta_relay *from, struct mta_relay *to,
+    struct mta_route *route)
+{
+	struct mta_connector	*c;
+
+	log_debug("debug: mta-routing: handing %s over from %s",
+	    mta_route_to_text(route), mta_relay_to_text(from));
+
+	c = mta_connector(from, route->src);
+	c->nconn -= 1;
+	from->nconn -= 1;
+	from->domain->nconn -= 1;
+
+	c = mta_connector(to, route->src);
+	c->nconn += 1;
+	to->nconn += 1;
+	to->domain->nconn += 1;
+
+	mta_relay_ref(to);
+	mta_relay_unref(from); /* from mta_connect() */
+}
+
+/*
+ * Outcome of a command on the route: the final reply to a transaction
+ * along with its duration in ms, any 4xx or 5xx reply, or NULL for a
+ * timeout.  It is recorded in the host and domain statistics, and used
+ * to adapt the number of connections: grow by one after a window of
+ * quick successes, halve on temporary failures.
+ */
+void
+mta_route_feedback(struct mta_relay *relay, struct mta_route *route,
+    const char *reply, int msecs)
+{
+	struct mta_limits	*l = relay->limits;
+	struct mta_stats	*hst, *dst;
+	int			 ok;
+
+	/* permanent failures and slow successes leave the window alone */
+	if (reply && reply[0] == '5')
+		ok = -1;
+	else if (reply && reply[0] == '2')
+		ok = msecs < AIMD_SLOW ? 1 : -1;
+	else
+		ok = 0;
+
+	if (l && l->adaptive && ok != -1) {
+		mta_aimd_update(&route->dst->aimd, l->maxconn_per_host, ok);
+		mta_aimd_update(&relay->domain->aimd, l->maxconn_per_domain,
+		    ok);
+		routegen++;
+	}
+
+	hst = mta_stats("host", sa_to_text(route->dst->sa), 1);
+	dst = mta_stats("domain", relay->domain->name, 1);
+	if (hst) {
+		mta_stats_update(hst, reply, msecs);
+		hst->window = route->dst->aimd.window;
+	}
+	if (dst) {
+		mta_stats_update(dst, reply, msecs);
+		dst->window = relay->domain->aimd.window;
+	}
+}
+
+static struct mta_stats *
+mta_stats(const char *type, const char *name, int create)
+{
+	struct mta_stats	*st;
+	char			 key[sizeof(st->name)];
+
+	if (!bsnprintf(key, sizeof key, "%s:%s", type, name))
+		return (NULL);
+
+	if ((st = dict_get(&hoststats, key)) || !create)
+		return (st);
+
+	if (dict_count(&hoststats) >= STATS_MAX)
+		return (NULL);
+
+	st = xcalloc(1, sizeof *st, "mta_stats");
+	(void)strlcpy(st->name, key, sizeof st->name);
+	dict_xset(&hoststats, st->name, st);
+	return (st);
+}
+
+static void
+mta_stats_update(struct mta_stats *st, const char *reply, int msecs)
+{
+	struct timeval	 tv;
+	int		 i;
+
+	st->tm = time(NULL);
+
+	if (reply == NULL || reply[0] == '4') {
+		st->tempfail++;
+		st->tm4xx = st->tm;
+		(void)strlcpy(st->last4xx, reply ? reply : "Connection timeout",
+		    sizeof st->last4xx);
+	}
+	else if (reply[0] == '5') {
+		st->permfail++;
+		st->tm5xx = st->tm;
+		(void)strlcpy(st->last5xx, reply, sizeof st->last5xx);
+	}
+	else {
+		st->ok++;
+		for (i = 0; i < MTA_STATS_LATENCY - 1; i++)
+			if (msecs < (100 << i))
+				break;
+		st->latency[i]++;
+	}
+
+	dict_set(&hoststats_dirty, st->name, st);
+	if (!evtimer_pending(&ev_hoststats, NULL)) {
+		tv.tv_sec = STATS_SYNC_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_hoststats, &tv);
+	}
+}
+
+/*
+ * Statistics saved by the queue in a previous run.
+ */
+static void
+mta_stats_load(struct mta_stats *saved)
+{
+	struct mta_stats	*st, *sent;
+	const char		*name;
+
+	saved->name[sizeof(saved->name) - 1] = '\0';
+	saved->last4xx[sizeof(saved->last4xx) - 1] = '\0';
+	saved->last5xx[sizeof(saved->last5xx) - 1] = '\0';
+
+	if ((st = dict_get(&hoststats, saved->name)) == NULL) {
+		if (dict_count(&hoststats) >= STATS_MAX)
+			return;
+		st = xcalloc(1, sizeof *st, "mta_stats_load");
+		(void)strlcpy(st->name, saved->name, sizeof st->name);
+		dict_xset(&hoststats, st->name, st);
+	}
+	mta_stats_merge(st, saved);
+
+	/* the queue already has these, only send what comes next */
+	if ((sent = dict_get(&hoststats_sent, st->name)) == NULL) {
+		sent = xcalloc(1, sizeof *sent, "mta_stats_load");
+		dict_xset(&hoststats_sent, st->name, sent);
+	}
+	mta_stats_merge(sent, saved);
+
+	/* restore recent errors for the domain */
+	if (strncmp(st->name, "domain:", 7) == 0) {
+		name = st->name + 7;
+		if (st->tm4xx > st->tm5xx &&
+		    st->tm4xx + HOSTSTAT_EXPIRE_DELAY > time(NULL))
+			mta_hoststat_update(name, st->last4xx);
+		else if (st->tm5xx &&
+		    st->tm5xx + HOSTSTAT_EXPIRE_DELAY > time(NULL))
+			mta_hoststat_update(name, st->last5xx);
+	}
+}
+
+/*
+ * Upper bound, in ms, of the given latency percentile.
+ */
+static int
+mta_stats_percentile(struct mta_stats *st, int percent)
+{
+	uint64_t	n;
+	int		i;
+
+	if (st->ok == 0)
+		return (-1);
+
+	n = 0;
+	for (i = 0; i < MTA_STATS_LATENCY - 1; i++) {
+		n += st->latency[i];
+		if (n * 100 >= st->ok * percent)
+			break;
+	}
+	return (100 << i);
+}
+
+/*
+ * Add the counters of a record to another one, and keep the most
+ * recent of the other fields.
+ */
+void
+mta_stats_merge(struct mta_stats *st, const struct mta_stats *from)
+{
+	int	i;
+
+	st->ok += from->ok;
+	st->tempfail += from->tempfail;
+	st->permfail += from->permfail;
+	for (i = 0; i < MTA_STATS_LATENCY; i++)
+		st->latency[i] += from->latency[i];
+
+	if (from->tm > st->tm) {
+		st->tm = from->tm;
+		st->window = from->window;
+	}
+	if (from->tm4xx > st->tm4xx) {
+		st->tm4xx = from->tm4xx;
+		(void)strlcpy(st->last4xx, from->last4xx, sizeof st->last4xx);
+	}
+	if (from->tm5xx > st->tm5xx) {
+		st->tm5xx = from->tm5xx;
+		(void)strlcpy(st->last5xx, from->last5xx, sizeof st->last5xx);
+	}
+}
+
+/*
+ * Send updated statistics to the queue, which keeps them on disk.
+ * Each pony worker has its own view of a host, so only the counts
+ * added since the last update are sent, and the queue sums them.
+ */
+static void
+mta_stats_sync(int fd, short event, void *arg)
+{
+	struct mta_stats	*st, *sent, delta;
+	int			 i;
+
+	while (dict_poproot(&hoststats_dirty, (void **)&st)) {
+		if ((sent = dict_get(&hoststats_sent, st->name)) == NULL) {
+			sent = xcalloc(1, sizeof *sent, "mta_stats_sync");
+			dict_xset(&hoststats_sent, st->name, sent);
+		}
+
+		delta = *st;
+		delta.ok -= sent->ok;
+		delta.tempfail -= sent->tempfail;
+		delta.permfail -= sent->permfail;
+		for (i = 0; i < MTA_STATS_LATENCY; i++)
+			delta.latency[i] -= sent->latency[i];
+		*sent = *st;
+
+		m_compose(p_queue, IMSG_MTA_HOSTSTATS, 0, 0, -1,
+		    &delta, sizeof delta);
+	}
+}
+
+static void
+mta_aimd_update(struct mta_aimd *a, size_t max, int ok)
+{
+	time_t	now;
+
+	if (a->window == 0)
+		a->window = MIN(AIMD_WINDOW_INIT, max);
+
+	if (ok) {
+		if (++a->acked < a->window)
+			return;
+		a->acked = 0;
+		if (a->window < max)
+			a->window += 1;
+		return;
+	}
+
+	/* one cut per second for a burst of failures */
+	now = time(NULL);
+	if (a->lastcut == now)
+		return;
+	a->lastcut = now;
+	a->acked = 0;
+	a->window = a->window > 1 ? a->window / 2 : 1;
+}
+
+static size_t
+mta_maxconn(struct mta_limits *l, struct mta_aimd *a, size_t max)
+{
+	if (!l->adaptive)
+		return (max);
+	if (a->window == 0)
+		return (MIN(AIMD_WINDOW_INIT, max));
+	return (MIN(a->window, max));
+}
+
 void
 mta_route_collect(struct mta_relay *relay, struct mta_route *route)
 {
@@ -668,28 +1079,64 @@ mta_route_collect(struct mta_relay *relay, struct mta_route *route)
 	route->src->nconn -= 1;
 	route->dst->nconn -= 1;
 	route->lastdisc = time(NULL);
+	routegen++;
 
 	/* First connection failed */
-	if (route->flags & ROUTE_NEW)
+	if (route->flags & ROUTE_NEW && !(route->flags & ROUTE_CANCEL))
 		mta_route_disable(route, 1, ROUTE_DISABLED_NET);
+	route->flags &= ~(ROUTE_STALLED|ROUTE_CANCEL);
 
 	c = mta_connector(relay, route->src);
 	c->nconn -= 1;
-	mta_connect(c);
+	mta_connect(c, 0);
 	mta_route_unref(route); /* from mta_find_route() */
 	mta_relay_unref(relay); /* from mta_connect() */
 }
 
+/*
+ * Leave recent tasks some time to collect more recipients, unless they
+ * are already full.  Return the first task that can be started now, or
+ * NULL and the time at which the oldest one will be released.
+ */
+static struct mta_task *
+mta_task_ready(struct mta_relay *relay, time_t *when)
+{
+	struct mta_task	*task;
+	time_t		 now;
+
+	now = time(NULL);
+	TAILQ_FOREACH(task, &relay->tasks, entry) {
+		if (relay->limits == NULL ||
+		    relay->limits->task_coalesce == 0 ||
+		    task->creation + relay->limits->task_coalesce <= now)
+			return (task);
+		if (relay->limits->task_max_rcpt &&
+		    task->nenvelope >= relay->limits->task_max_rcpt)
+			return (task);
+	}
+
+	if (when && (task = TAILQ_FIRST(&relay->tasks)))
+		*when = task->creation + relay->limits->task_coalesce;
+
+	return (NULL);
+}
+
 struct mta_task *
 mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 {
 	struct mta_task	*task;
 
-	if ((task = TAILQ_FIRST(&relay->tasks))) {
+	task = mta_task_ready(relay, NULL);
+	if (task) {
 		TAILQ_REMOVE(&relay->tasks, task, entry);
 		relay->ntask -= 1;
 		task->relay = NULL;
 
+		relay->ntx += 1;
+		relay->nrcpt += task->nenvelope;
+		stat_increment("mta.transaction", 1);
+		stat_increment("mta.transaction.rcpt", task->nenvelope);
+
 		/* When the number of tasks is down to lowat, query some evp */
 		if (relay->ntask == (size_t)relay->limits->task_lowat) {
 			if (relay->state & RELAY_ONHOLD) {
@@ -837,6 +1284,7 @@ mta_query_limits(struct mta_relay *relay)
 	relay->limits = dict_get(env->sc_limits_dict, relay->domain->name);
 	if (relay->limits == NULL)
 		relay->limits = dict_get(env->sc_limits_dict, "default");
+	routegen++;
 
 	if (max_seen_conndelay_route < relay->limits->conndelay_route)
 		max_seen_conndelay_route = relay->limits->conndelay_route;
@@ -984,6 +1432,7 @@ mta_on_preference(struct mta_relay *relay, int preference)
 	    mta_relay_to_text(relay), preference);
 
 	relay->backuppref = preference;
+	routegen++;
 
 	relay->status &= ~RELAY_WAIT_PREFERENCE;
 	mta_drain(relay);
@@ -1009,7 +1458,7 @@ mta_on_source(struct mta_relay *relay, struct mta_source *source)
 			c->flags &= ~CONNECTOR_NEW;
 			delay = DELAY_CHECK_SOURCE;
 		}
-		mta_connect(c);
+		mta_connect(c, 0);
 		if ((c->flags & CONNECTOR_ERROR) == 0)
 			relay->sourceloop = 0;
 		else
@@ -1054,8 +1503,13 @@ mta_on_source(struct mta_relay *relay, struct mta_source *source)
 	mta_relay_unref(relay); /* from mta_query_source() */
 }
 
+/*
+ * Open new connections for the connector as needed.  A race is the
+ * single fallback attempt for a stalled connection: it is started right
+ * away, and whatever the outcome it is not retried as such.
+ */
 static void
-mta_connect(struct mta_connector *c)
+mta_connect(struct mta_connector *c, int race)
 {
 	struct mta_route	*route;
 	struct mta_limits	*l = c->relay->limits;
@@ -1090,28 +1544,48 @@ mta_connect(struct mta_connector *c)
 		return;
 	}
 
+	/* Tasks are still collecting recipients, see mta_drain(). */
+	if (mta_task_ready(c->relay, NULL) == NULL) {
+		log_debug("debug: mta: no task ready for connector");
+		return;
+	}
+
 	/* Do not create more connections than necessary */
-	if ((c->relay->nconn_ready >= c->relay->ntask) ||
-	    (c->relay->nconn > 2 && c->relay->nconn >= c->relay->ntask / 2)) {
+	if (!race && ((c->relay->nconn_ready >= c->relay->ntask) ||
+	    (c->relay->nconn > 2 && c->relay->nconn >= c->relay->ntask / 2))) {
 		log_debug("debug: mta: enough connections already");
 		return;
 	}
 
+	/*
+	 * Take over an idle connection to one of the MXs before opening
+	 * a new one.
+	 */
+	if (!race &&
+	    c->nconn < l->maxconn_per_connector &&
+	    c->relay->nconn < l->maxconn_per_relay &&
+	    c->relay->domain->nconn < mta_maxconn(l, &c->relay->domain->aimd,
+	    l->maxconn_per_domain) &&
+	    mta_reuse(c))
+		goto again;
+
 	limits = 0;
 	nextconn = now = time(NULL);
 
-	if (c->relay->domain->lastconn + l->conndelay_domain > nextconn) {
+	if (!race &&
+	    c->relay->domain->lastconn + l->conndelay_domain > nextconn) {
 		log_debug("debug: mta: cannot use domain %s before %llus",
 		    c->relay->domain->name,
 		    (unsigned long long) c->relay->domain->lastconn + l->conndelay_domain - now);
 		nextconn = c->relay->domain->lastconn + l->conndelay_domain;
 	}
-	if (c->relay->domain->nconn >= l->maxconn_per_domain) {
+	if (c->relay->domain->nconn >= mta_maxconn(l, &c->relay->domain->aimd,
+	    l->maxconn_per_domain)) {
 		log_debug("debug: mta: hit domain limit");
 		limits |= CONNECTOR_LIMIT_DOMAIN;
 	}
 
-	if (c->source->lastconn + l->conndelay_source > nextconn) {
+	if (!race && c->source->lastconn + l->conndelay_source > nextconn) {
 		log_debug("debug: mta: cannot use source %s before %llus",
 		    mta_source_to_text(c->source),
 		    (unsigned long long) c->source->lastconn + l->conndelay_source - now);
@@ -1122,7 +1596,7 @@ mta_connect(struct mta_connector *c)
 		limits |= CONNECTOR_LIMIT_SOURCE;
 	}
 
-	if (c->lastconn + l->conndelay_connector > nextconn) {
+	if (!race && c->lastconn + l->conndelay_connector > nextconn) {
 		log_debug("debug: mta: cannot use %s before %llus",
 		    mta_connector_to_text(c),
 		    (unsigned long long) c->lastconn + l->conndelay_connector - now);
@@ -1133,7 +1607,7 @@ mta_connect(struct mta_connector *c)
 		limits |= CONNECTOR_LIMIT_CONN;
 	}
 
-	if (c->relay->lastconn + l->conndelay_relay > nextconn) {
+	if (!race && c->relay->lastconn + l->conndelay_relay > nextconn) {
 		log_debug("debug: mta: cannot use %s before %llus",
 		    mta_relay_to_text(c->relay),
 		    (unsigned long long) c->relay->lastconn + l->conndelay_relay - now);
@@ -1181,6 +1655,7 @@ mta_connect(struct mta_connector *c)
 
 	c->nconn += 1;
 	c->lastconn = time(NULL);
+	c->lastfamily = route->dst->sa->sa_family;
 
 	c->relay->nconn += 1;
 	c->relay->lastconn = c->lastconn;
@@ -1192,13 +1667,46 @@ mta_connect(struct mta_connector *c)
 	route->src->lastconn = c->lastconn;
 	route->dst->nconn += 1;
 	route->dst->lastconn = c->lastconn;
+	routegen++;
 
-	mta_session(c->relay, route);	/* this never fails synchronously */
+	mta_session(c->relay, route, race); /* this never fails synchronously */
 	mta_relay_ref(c->relay);
 
+	/* Only one fallback per stalled attempt */
+	if (race)
+		return;
+
     goto again;
 }
 
+static int
+mta_reuse(struct mta_connector *c)
+{
+	struct mta_route	 key, *route;
+	struct mta_mx		*mx;
+
+	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry) {
+		if (c->relay->backuppref >= 0 &&
+		    mx->preference >= c->relay->backuppref)
+			break;
+		if (mx->host->flags & HOST_IGNORE)
+			continue;
+
+		key.src = c->source;
+		key.dst = mx->host;
+		route = SPLAY_FIND(mta_route_tree, &routes, &key);
+		if (route == NULL || route->flags & ROUTE_DISABLED)
+			continue;
+
+		if (mta_session_reuse(c->relay, route)) {
+			c->lastconn = time(NULL);
+			return (1);
+		}
+	}
+
+	return (0);
+}
+
 static void
 mta_on_timeout(struct runq *runq, void *arg)
 {
@@ -1214,11 +1722,17 @@ mta_on_timeout(struct runq *runq, void *arg)
 		mta_drain(relay);
 		mta_relay_unref(relay); /* from mta_drain() */
 	}
+	else if (runq == runq_coalesce) {
+		log_debug("debug: mta: ... coalescing done for %s",
+		    mta_relay_to_text(relay));
+		mta_drain(relay);
+		mta_relay_unref(relay); /* from mta_drain() */
+	}
 	else if (runq == runq_connector) {
 		log_debug("debug: mta: ... timeout for %s",
 		    mta_connector_to_text(connector));
 		connector->flags &= ~CONNECTOR_WAIT;
-		mta_connect(connector);
+		mta_connect(connector, 0);
 	}
 	else if (runq == runq_route) {
 		route->flags &= ~ROUTE_RUNQ;
@@ -1257,6 +1771,7 @@ mta_route_disable(struct mta_route *route, int penalty, int reason)
 
 	route->flags |= reason & ROUTE_DISABLED;
 	runq_schedule(runq_route, time(NULL) + delay, NULL, route);
+	routegen++;
 }
 
 static void
@@ -1268,6 +1783,7 @@ mta_route_enable(struct mta_route *route)
 		route->flags &= ~ROUTE_DISABLED;
 		route->flags |= ROUTE_NEW;
 		route->nerror = 0;
+		routegen++;
 	}
 
 	if (route->penalty) {
@@ -1284,6 +1800,7 @@ static void
 mta_drain(struct mta_relay *r)
 {
 	char			 buf[64];
+	time_t			 when;
 
 	log_debug("debug: mta: draining %s "
 	    "refcount=%d, ntask=%zu, nconnector=%zu, nconn=%zu",
@@ -1340,6 +1857,21 @@ mta_drain(struct mta_relay *r)
 		return;
 	}
 
+	/*
+	 * Do not open connections for tasks that are still collecting
+	 * recipients: idle sessions would give up before they are ready.
+	 * Come back when the oldest one is released.
+	 */
+	if (mta_task_ready(r, &when) == NULL) {
+		if (!runq_pending(runq_coalesce, NULL, r, NULL)) {
+			runq_schedule(runq_coalesce, when, NULL, r);
+			mta_relay_ref(r);
+		}
+		log_debug("debug: mta: %s coalescing tasks",
+		    mta_relay_to_text(r));
+		return;
+	}
+
 	/*
 	 * We have pending task, and it's maybe time too try a new source.
 	 */
@@ -1427,16 +1959,28 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 	struct mta_route	*route, *best;
 	struct mta_limits	*l = c->relay->limits;
 	struct mta_mx		*mx;
-	int			 level, limit_host, limit_route;
-	int			 family_mismatch, seen, suspended_route;
+	int			 level, limit_host, limit_route, stalled;
+	int			 family_mismatch, seen, suspended_route, alt;
 	time_t			 tm;
 
+	/* Nothing changed since the last search failed */
+	if (c->routegen == routegen &&
+	    (c->routenext == 0 || c->routenext > now)) {
+		log_debug("debug: mta-routing: no new route for %s",
+		    mta_connector_to_text(c));
+		*limits |= c->routelimits;
+		if (c->routenext > *nextconn)
+			*nextconn = c->routenext;
+		return (NULL);
+	}
+
 	log_debug("debug: mta-routing: searching new route for %s...",
 	    mta_connector_to_text(c));
 
 	tm = 0;
 	limit_host = 0;
 	limit_route = 0;
+	stalled = 0;
 	suspended_route = 0;
 	family_mismatch = 0;
 	level = -1;
@@ -1493,7 +2037,8 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 			continue;
 		}
 
-		if (mx->host->nconn >= l->maxconn_per_host) {
+		if (mx->host->nconn >= mta_maxconn(l, &mx->host->aimd,
+		    l->maxconn_per_host)) {
 			log_debug("debug: mta-routing: skipping host %s: too many connections",
 			    mta_host_to_text(mx->host));
 			limit_host = 1;
@@ -1519,6 +2064,18 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 			continue;
 		}
 
+		/*
+		 * Do not wait for a stalled route, and allow looking
+		 * for a fallback on the next preference level.
+		 */
+		if (route->flags & ROUTE_STALLED) {
+			log_debug("debug: mta-routing: skipping route %s: connection stalled",
+			    mta_route_to_text(route));
+			stalled = 1;
+			mta_route_unref(route); /* from here */
+			continue;
+		}
+
 		if (route->nconn && (route->flags & ROUTE_NEW)) {
 			log_debug("debug: mta-routing: skipping route %s: not validated yet",
 			    mta_route_to_text(route));
@@ -1555,8 +2112,15 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 			continue;
 		}
 
-		/* Use the route with the lowest number of connections. */
-		if (best && route->nconn >= best->nconn) {
+		/*
+		 * Use the route with the lowest number of connections,
+		 * alternating address families between attempts.
+		 */
+		alt = best &&
+		    best->dst->sa->sa_family == c->lastfamily &&
+		    route->dst->sa->sa_family != c->lastfamily;
+		if (best && (route->nconn > best->nconn ||
+		    (route->nconn == best->nconn && !alt))) {
 			log_debug("debug: mta-routing: skipping route %s: current one is better",
 			    mta_route_to_text(route));
 			mta_route_unref(route); /* from here */
@@ -1579,17 +2143,31 @@ mta_find_route(struct mta_connector *c, time_t now, int *limits,
 		    mta_connector_to_text(c));
 		c->flags |= CONNECTOR_ERROR_MX;
 	}
-	else if (limit_route) {
+	else if (limit_route || stalled) {
 		log_debug("debug: mta: hit route limit");
 		*limits |= CONNECTOR_LIMIT_ROUTE;
+		c->routegen = routegen;
+		c->routelimits = CONNECTOR_LIMIT_ROUTE;
+		c->routenext = tm;
 	}
 	else if (limit_host) {
 		log_debug("debug: mta: hit host limit");
 		*limits |= CONNECTOR_LIMIT_HOST;
+		c->routegen = routegen;
+		c->routelimits = CONNECTOR_LIMIT_HOST;
+		c->routenext = tm;
 	}
 	else if (tm) {
 		if (tm > *nextconn)
 			*nextconn = tm;
+		c->routegen = routegen;
+		c->routelimits = 0;
+		c->routenext = tm;
+	}
+	else if (c->relay->domain->mxpending) {
+		/* more MXs are still being resolved, check again soon */
+		if (now + 1 > *nextconn)
+			*nextconn = now + 1;
 	}
 	else if (family_mismatch) {
 		log_info("smtp-out: Address family mismatch on %s",
@@ -1852,10 +2430,12 @@ mta_relay_show(struct mta_relay *r, struct mproc *p, uint32_t id, time_t t)
 	else
 		(void)strlcpy(dur, "-", sizeof(dur));
 
-	(void)snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu nconn=%zu lastconn=%s timeout=%s wait=%s%s",
+	(void)snprintf(buf, sizeof(buf), "%s refcount=%d ntask=%zu ntx=%zu rcpt/tx=%.1f nconn=%zu lastconn=%s timeout=%s wait=%s%s",
 	    mta_relay_to_text(r),
 	    r->refcount,
 	    r->ntask,
+	    r->ntx,
+	    r->ntx ? (double)r->nrcpt / r->ntx : 0.0,
 	    r->nconn,
 	    r->lastconn ? duration_to_text(t - r->lastconn) : "-",
 	    dur,
@@ -1987,6 +2567,7 @@ static struct mta_host *
 mta_host(const struct sockaddr *sa)
 {
 	struct mta_host		key, *h;
+	struct mta_stats	*st;
 	struct sockaddr_storage	ss;
 
 	memmove(&ss, sa, SA_LEN(sa));
@@ -1996,6 +2577,8 @@ mta_host(const struct sockaddr *sa)
 	if (h == NULL) {
 		h = xcalloc(1, sizeof(*h), "mta_host");
 		h->sa = xmemdup(sa, SA_LEN(sa), "mta_host");
+		if ((st = mta_stats("host", sa_to_text(sa), 0)))
+			h->aimd.window = st->window;
 		SPLAY_INSERT(mta_host_tree, &hosts, h);
 		stat_increment("mta.host", 1);
 	}
@@ -2053,6 +2636,7 @@ static struct mta_domain *
 mta_domain(char *name, int flags)
 {
 	struct mta_domain	key, *d;
+	struct mta_stats	*st;
 
 	key.name = name;
 	key.flags = flags;
@@ -2063,6 +2647,8 @@ mta_domain(char *name, int flags)
 		d->name = xstrdup(name, "mta_domain");
 		d->flags = flags;
 		TAILQ_INIT(&d->mxs);
+		if ((st = mta_stats("domain", name, 0)))
+			d->aimd.window = st->window;
 		SPLAY_INSERT(mta_domain_tree, &domains, d);
 		stat_increment("mta.domain", 1);
 	}
@@ -2246,6 +2832,9 @@ mta_route(struct mta_source *src, struct mta_host *dst)
 		r->dst = dst;
 		r->flags |= ROUTE_NEW;
 		r->id = ++rid;
+		/* keep route ids unique across pony workers */
+		if (env->sc_pony_workers > 1)
+			r->id |= (uint64_t)pony_worker << PONY_WORKER_SHIFT;
 		SPLAY_INSERT(mta_route_tree, &routes, r);
 		mta_source_ref(src);
 		mta_host_ref(dst);
@@ -2321,6 +2910,8 @@ mta_route_unref(struct mta_route *r)
 	SPLAY_REMOVE(mta_route_tree, &routes, r);
 	mta_source_unref(r->src); /* from constructor */
 	mta_host_unref(r->dst); /* from constructor */
+	if (r->tls_session)
+		SSL_SESSION_free(r->tls_session);
 	free(r);
 	stat_decrement("mta.route", 1);
 }
@@ -53,6 +53,13 @@
 
 #define MTA_HIWAT		65535
 
+/* recipients in flight when the server allows PIPELINING */
+#define MTA_RCPT_WINDOW		100
+
+/* size of the BDAT chunks sent when the server allows CHUNKING */
+#define MTA_CHUNK_SIZE		65536
+#define MTA_CONNECT_DELAY	250	/* ms before racing another route */
+
 enum mta_state {
 	MTA_INIT,
 	MTA_BANNER,
@@ -76,6 +83,32 @@ enum mta_state {
 	MTA_QUIT,
 };
 
+/* stages of a delivery, as reported in the latency histograms */
+enum mta_stage {
+	MTA_STAGE_NONE,
+	MTA_STAGE_DNS,
+	MTA_STAGE_CONNECT,
+	MTA_STAGE_TLS,
+	MTA_STAGE_BANNER,
+	MTA_STAGE_HELO,
+	MTA_STAGE_MAIL,
+	MTA_STAGE_DATA,
+	MTA_STAGE_EOM,
+	MTA_STAGE_MAX
+};
+
+static const char *mta_stages[MTA_STAGE_MAX] = {
+	"none", "dns", "connect", "tls", "banner", "helo", "mail", "data", "eom"
+};
+
+#define MTA_LATENCY_BUCKETS	17	/* buckets of 1ms * 2^i */
+#define MTA_LATENCY_FLUSH	10	/* seconds between stat updates */
+#define MTA_LATENCY_MAXRELAY	64	/* relay domains with their own histograms */
+
+struct mta_latency {
+	uint64_t	hist[MTA_STAGE_MAX][MTA_LATENCY_BUCKETS];
+};
+
 #define MTA_FORCE_ANYSSL	0x0001
 #define MTA_FORCE_SMTPS		0x0002
 #define MTA_FORCE_TLS     	0x0004
@@ -95,14 +128,18 @@ enum mta_state {
 #define MTA_WAIT		0x1000
 #define MTA_HANGON		0x2000
 #define MTA_RECONN		0x4000
+#define MTA_RACE		0x8000
+#define MTA_IDLE		0x10000
 
 #define MTA_EXT_STARTTLS	0x01
 #define MTA_EXT_PIPELINING	0x02
 #define MTA_EXT_AUTH		0x04
 #define MTA_EXT_AUTH_PLAIN     	0x08
 #define MTA_EXT_AUTH_LOGIN     	0x10
+#define MTA_EXT_CHUNKING	0x20
 
 struct mta_session {
+	TAILQ_ENTRY(mta_session) idle;
 	uint64_t		 id;
 	struct mta_relay	*relay;
 	struct mta_route	*route;
@@ -121,38 +158,62 @@ struct mta_session {
 	struct io		 io;
 	int			 ext;
 
+	struct timespec		 txstart;
 	size_t			 msgtried;
 	size_t			 msgcount;
 	size_t			 rcptcount;
 	int			 hangon;
 
 	enum mta_state		 state;
+	enum mta_stage		 stage;
+	struct timespec		 tstage;
 	struct mta_task		*task;
 	struct mta_envelope	*currevp;
+	struct mta_envelope	*nextevp;
+	size_t			 rcptwait;
+	size_t			 chunkwait;
+	size_t			 skipreplies;
 	FILE			*datafp;
+	char			*chunk;
+	size_t			 chunksz;
 
 	size_t			 failures;
 
 	char			 replybuf[2048];
 };
 
+struct mta_pool {
+	TAILQ_HEAD(, mta_session) sessions;
+};
+
 static void mta_session_init(void);
 static void mta_start(int fd, short ev, void *arg);
+static void mta_on_stall(int fd, short ev, void *arg);
+static void mta_race_won(struct mta_session *);
+static void mta_pool_add(struct mta_session *);
+static void mta_pool_del(struct mta_session *);
+static int mta_pool_match(struct mta_relay *, struct mta_relay *);
 static void mta_io(struct io *, int, void *);
 static void mta_free(struct mta_session *);
 static void mta_on_ptr(void *, void *, void *);
+static void mta_stage(struct mta_session *, enum mta_stage);
+static void mta_latency_flush(int, short, void *);
 static void mta_on_timeout(struct runq *, void *);
 static void mta_connect(struct mta_session *);
 static void mta_enter_state(struct mta_session *, int);
 static void mta_flush_task(struct mta_session *, int, const char *, size_t, int);
 static void mta_error(struct mta_session *, const char *, ...);
 static void mta_send(struct mta_session *, char *, ...);
+static void mta_send_rcpt(struct mta_session *);
 static ssize_t mta_queue_data(struct mta_session *);
+static ssize_t mta_queue_chunk(struct mta_session *);
 static void mta_response(struct mta_session *, char *);
 static const char * mta_strstate(int);
 static void mta_start_tls(struct mta_session *);
 static int mta_verify_certificate(struct mta_session *);
 static void mta_tls_verified(struct mta_session *);
+static void mta_tls_resume(struct mta_session *, void *);
+static void mta_tls_save_session(struct mta_session *);
 static struct mta_session *mta_tree_pop(struct tree *, uint64_t);
 static const char * dsn_strret(enum dsn_ret);
 static const char * dsn_strnotify(uint8_t);
@@ -167,9 +228,16 @@ static struct tree wait_ptr;
 static struct tree wait_fd;
 static struct tree wait_ssl_init;
 static struct tree wait_ssl_verify;
+static struct tree racing;
+static struct tree pool;
 
 static struct runq *hangon;
 
+static struct mta_latency latency;
+static struct dict latency_relays;
+static struct dict latency_domains;
+static struct event ev_latency;
+
 static void
 mta_session_init(void)
 {
@@ -181,13 +249,18 @@ mta_session_init(void)
 		tree_init(&wait_fd);
 		tree_init(&wait_ssl_init);
 		tree_init(&wait_ssl_verify);
+		tree_init(&racing);
+		tree_init(&pool);
 		runq_init(&hangon, mta_on_timeout);
+		dict_init(&latency_relays);
+		dict_init(&latency_domains);
+		evtimer_set(&ev_latency, mta_latency_flush, NULL);
 		init = 1;
 	}
 }
 
 void
-mta_session(struct mta_relay *relay, struct mta_route *route)
+mta_session(struct mta_relay *relay, struct mta_route *route, int race)
 {
 	struct mta_session	*s;
 	struct timeval		 tv;
@@ -229,6 +302,12 @@ mta_session(struct mta_relay *relay, struct mta_route *route)
 	if (relay->flags & RELAY_BACKUP)
 		s->flags &= ~MTA_FORCE_PLAIN;
 
+	/* spawned as a fallback for a stalled connection */
+	if (race) {
+		s->flags |= MTA_RACE;
+		tree_xset(&racing, s->id, s);
+	}
+
 	log_debug("debug: mta: %p: spawned for relay %s", s,
 	    mta_relay_to_text(relay));
 	stat_increment("mta.session", 1);
@@ -248,6 +327,7 @@ mta_session(struct mta_relay *relay, struct mta_route *route)
 		m_close(p_lka);
 		tree_xset(&wait_ptr, s->id, s);
 		s->flags |= MTA_WAIT;
+		mta_stage(s, MTA_STAGE_DNS);
 	}
 }
 
@@ -331,6 +411,7 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 				ssl = ssl_mta_init(NULL, NULL, 0, env->sc_tls_ciphers);
 				if (ssl == NULL)
 					fatal("mta: ssl_mta_init");
+				mta_tls_resume(s, ssl);
 				io_start_tls(&s->io, ssl);
 				return;
 			}
@@ -343,6 +424,7 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 		    resp_ca_cert->cert, resp_ca_cert->cert_len, env->sc_tls_ciphers);
 		if (ssl == NULL)
 			fatal("mta: ssl_mta_init");
+		mta_tls_resume(s, ssl);
 		io_start_tls(&s->io, ssl);
 
 		explicit_bzero(resp_ca_cert->cert, resp_ca_cert->cert_len);
@@ -421,6 +503,9 @@ mta_free(struct mta_session *s)
 
 	log_debug("debug: mta: %p: session done", s);
 
+	/* account for the stage the session died in */
+	mta_stage(s, MTA_STAGE_NONE);
+
 	if (s->ready)
 		s->relay->nconn_ready -= 1;
 
@@ -429,6 +514,13 @@ mta_free(struct mta_session *s)
 		runq_cancel(hangon, NULL, s);
 	}
 
+	if (evtimer_pending(&s->ev, NULL))
+		evtimer_del(&s->ev);
+	if (s->flags & MTA_RACE)
+		tree_xpop(&racing, s->id);
+	if (s->flags & MTA_IDLE)
+		mta_pool_del(s);
+
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
 
@@ -436,6 +528,7 @@ mta_free(struct mta_session *s)
 		fatalx("current task should have been deleted already");
 	if (s->datafp)
 		fclose(s->datafp);
+	free(s->chunk);
 	free(s->helo);
 
 	relay = s->relay;
@@ -474,11 +567,156 @@ mta_start(int fd, short ev, void *arg)
 	mta_connect(s);
 }
 
+/*
+ * The connection is taking too long: let the mta start another attempt
+ * on a different route, the first one to connect wins.
+ */
+static void
+mta_on_stall(int fd, short ev, void *arg)
+{
+	struct mta_session *s = arg;
+
+	log_debug("debug: mta: %p: connection stalled", s);
+
+	if (!(s->flags & MTA_RACE)) {
+		s->flags |= MTA_RACE;
+		tree_xset(&racing, s->id, s);
+	}
+	mta_route_stalled(s->relay, s->route);
+}
+
+static void
+mta_race_won(struct mta_session *s)
+{
+	struct mta_session	*r;
+	void			*iter;
+	uint64_t		 id;
+
+	mta_route_connected(s->relay, s->route);
+
+	if (!(s->flags & MTA_RACE))
+		return;
+	s->flags &= ~MTA_RACE;
+	tree_xpop(&racing, s->id);
+
+    again:
+	iter = NULL;
+	while (tree_iter(&racing, &iter, &id, (void **)&r)) {
+		if (r->relay != s->relay)
+			continue;
+		log_debug("debug: mta: %p: cancelling connection, %p won",
+		    r, s);
+		r->flags &= ~MTA_RACE;
+		tree_xpop(&racing, id);
+		if (!(r->route->flags & ROUTE_STALLED))
+			mta_route_cancel(r->relay, r->route);
+		if (r->flags & MTA_WAIT)
+			r->flags |= MTA_FREE;
+		else
+			mta_free(r);
+		goto again;
+	}
+}
+
+/*
+ * Idle sessions are pooled by route, so that another relay with the
+ * same connection parameters can take them over.
+ */
+int
+mta_session_reuse(struct mta_relay *relay, struct mta_route *route)
+{
+	struct mta_pool		*p;
+	struct mta_session	*s;
+
+	if ((p = tree_get(&pool, route->id)) == NULL)
+		return (0);
+
+	TAILQ_FOREACH(s, &p->sessions, idle)
+		if (s->relay != relay && mta_pool_match(s->relay, relay))
+			break;
+	if (s == NULL)
+		return (0);
+
+	log_info("%016"PRIx64" mta event=reuse relay=%s",
+	    s->id, mta_relay_to_text(relay));
+	stat_increment("mta.session.reuse", 1);
+
+	mta_pool_del(s);
+	runq_cancel(hangon, NULL, s);
+	s->flags &= ~MTA_HANGON;
+	s->hangon = 0;
+
+	s->relay->nconn_ready -= 1;
+	mta_route_handoff(s->relay, relay, route);
+	s->relay = relay;
+	s->relay->nconn_ready += 1;
+
+	mta_enter_state(s, MTA_READY);
+	return (1);
+}
+
+static void
+mta_pool_add(struct mta_session *s)
+{
+	struct mta_pool	*p;
+
+	if (s->flags & MTA_IDLE)
+		return;
+
+	if ((p = tree_get(&pool, s->route->id)) == NULL) {
+		p = xcalloc(1, sizeof *p, "mta_pool_add");
+		TAILQ_INIT(&p->sessions);
+		tree_xset(&pool, s->route->id, p);
+	}
+	TAILQ_INSERT_TAIL(&p->sessions, s, idle);
+	s->flags |= MTA_IDLE;
+}
+
+static void
+mta_pool_del(struct mta_session *s)
+{
+	struct mta_pool	*p;
+
+	p = tree_xget(&pool, s->route->id);
+	TAILQ_REMOVE(&p->sessions, s, idle);
+	s->flags &= ~MTA_IDLE;
+
+	if (TAILQ_EMPTY(&p->sessions)) {
+		tree_xpop(&pool, s->route->id);
+		free(p);
+	}
+}
+
+/*
+ * A session can move between relays that only differ by destination
+ * domain: same TLS, authentication and helo parameters.
+ */
+static int
+mta_pool_match(struct mta_relay *a, struct mta_relay *b)
+{
+	if (a->flags != b->flags || a->port != b->port)
+		return (0);
+
+#define STREQ(x, y) ((x) == (y) || ((x) && (y) && !strcmp((x), (y))))
+	if (!STREQ(a->pki_name, b->pki_name) ||
+	    !STREQ(a->ca_name, b->ca_name) ||
+	    !STREQ(a->authtable, b->authtable) ||
+	    !STREQ(a->authlabel, b->authlabel) ||
+	    !STREQ(a->secret, b->secret) ||
+	    !STREQ(a->helotable, b->helotable) ||
+	    !STREQ(a->heloname, b->heloname))
+		return (0);
+#undef STREQ
+
+	return (1);
+}
+
 static void
 mta_connect(struct mta_session *s)
 {
 	struct sockaddr_storage	 ss;
 	struct sockaddr		*sa;
+	struct timeval		 tv;
 	int			 portno;
 	const char		*schema = "smtp+tls://";
 
@@ -502,6 +740,7 @@ mta_connect(struct mta_session *s)
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
 
+	s->rcptwait = s->chunkwait = s->skipreplies = 0;
 	s->use_smtps = s->use_starttls = s->use_smtp_tls = 0;
 
 	switch (s->attempt) {
@@ -573,7 +812,15 @@ mta_connect(struct mta_session *s)
 		else
 			mta_error(s, "Connection failed: %s", io_error(&s->io));
 		mta_free(s);
+		return;
 	}
+
+	if (evtimer_pending(&s->ev, NULL))
+		evtimer_del(&s->ev);
+	tv.tv_sec = 0;
+	tv.tv_usec = MTA_CONNECT_DELAY * 1000;
+	evtimer_set(&s->ev, mta_on_stall, s);
+	evtimer_add(&s->ev, &tv);
 }
 
 static void
@@ -596,6 +843,42 @@ mta_enter_state(struct mta_session *s, int newstate)
 
 	s->state = newstate;
 
+	switch (s->state) {
+	case MTA_INIT:
+		mta_stage(s, MTA_STAGE_CONNECT);
+		break;
+	case MTA_BANNER:
+		mta_stage(s, MTA_STAGE_BANNER);
+		break;
+	case MTA_STARTTLS:
+		mta_stage(s, MTA_STAGE_TLS);
+		break;
+	case MTA_EHLO:
+	case MTA_HELO:
+	case MTA_LHLO:
+	case MTA_AUTH:
+	case MTA_AUTH_PLAIN:
+	case MTA_AUTH_LOGIN:
+	case MTA_AUTH_LOGIN_USER:
+	case MTA_AUTH_LOGIN_PASS:
+		mta_stage(s, MTA_STAGE_HELO);
+		break;
+	case MTA_MAIL:
+	case MTA_RCPT:
+		mta_stage(s, MTA_STAGE_MAIL);
+		break;
+	case MTA_DATA:
+	case MTA_BODY:
+		mta_stage(s, MTA_STAGE_DATA);
+		break;
+	case MTA_EOM:
+	case MTA_LMTP_EOM:
+		mta_stage(s, MTA_STAGE_EOM);
+		break;
+	default:
+		mta_stage(s, MTA_STAGE_NONE);
+	}
+
 	memset(s->replybuf, 0, sizeof s->replybuf);
 
 	/* don't try this at home! */
@@ -712,6 +995,9 @@ mta_enter_state(struct mta_session *s, int newstate)
 		break;
 
 	case MTA_READY:
+		if (s->flags & MTA_IDLE)
+			mta_pool_del(s);
+
 		/* Ready to send a new mail */
 		if (s->ready == 0) {
 			s->ready = 1;
@@ -750,7 +1036,8 @@ mta_enter_state(struct mta_session *s, int newstate)
 			log_debug("debug: mta: %p: no task for relay %s",
 			    s, mta_relay_to_text(s->relay));
 
-			if (s->relay->nconn > 1 ||
+			/* hang on if tasks are still being coalesced */
+			if ((s->relay->nconn > 1 && s->relay->ntask == 0) ||
 			    s->hangon >= s->relay->limits->sessdelay_keepalive) {
 				mta_enter_state(s, MTA_QUIT);
 				break;
@@ -761,6 +1048,7 @@ mta_enter_state(struct mta_session *s, int newstate)
 			    s->hangon));
 			s->flags |= MTA_HANGON;
 			runq_schedule(hangon, time(NULL) + 1, NULL, s);
+			mta_pool_add(s);
 			break;
 		}
 
@@ -780,10 +1068,12 @@ mta_enter_state(struct mta_session *s, int newstate)
 
 	case MTA_MAIL:
 		s->currevp = TAILQ_FIRST(&s->task->envelopes);
+		s->nextevp = s->currevp;
 
 		e = s->currevp;
 		s->hangon = 0;
 		s->msgtried++;
+		clock_gettime(CLOCK_MONOTONIC, &s->txstart);
 		envid_sz = strlen(e->dsn_envid);
 		if (s->ext & MTA_EXT_DSN) {
 			mta_send(s, "MAIL FROM:<%s>%s%s%s%s",
@@ -794,28 +1084,22 @@ mta_enter_state(struct mta_session *s, int newstate)
 			    envid_sz ? e->dsn_envid : "");
 		} else
 			mta_send(s, "MAIL FROM:<%s>", s->task->sender);
+
+		/* do not wait for the MAIL reply to send recipients */
+		if (s->ext & MTA_EXT_PIPELINING)
+			mta_send_rcpt(s);
 		break;
 
 	case MTA_RCPT:
-		if (s->currevp == NULL)
-			s->currevp = TAILQ_FIRST(&s->task->envelopes);
-
-		e = s->currevp;
-		if (s->ext & MTA_EXT_DSN) {
-			mta_send(s, "RCPT TO:<%s>%s%s%s%s",
-			    e->dest,
-			    e->dsn_notify ? " NOTIFY=" : "",
-			    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
-			    e->dsn_orcpt ? " ORCPT=" : "",
-			    e->dsn_orcpt ? e->dsn_orcpt : "");
-		} else
-			mta_send(s, "RCPT TO:<%s>", e->dest);
-
-		s->rcptcount++;
+		mta_send_rcpt(s);
 		break;
 
 	case MTA_DATA:
 		fseek(s->datafp, 0, SEEK_SET);
+		if (s->ext & MTA_EXT_CHUNKING) {
+			mta_enter_state(s, MTA_BODY);
+			break;
+		}
 		mta_send(s, "DATA");
 		break;
 
@@ -826,7 +1110,16 @@ mta_enter_state(struct mta_session *s, int newstate)
 			break;
 		}
 
-		if ((q = mta_queue_data(s)) == -1) {
+		/* without PIPELINING, wait for the reply to the last chunk */
+		if (s->ext & MTA_EXT_CHUNKING &&
+		    !(s->ext & MTA_EXT_PIPELINING) && s->chunkwait)
+			break;
+
+		if (s->ext & MTA_EXT_CHUNKING)
+			q = mta_queue_chunk(s);
+		else
+			q = mta_queue_data(s);
+		if (q == -1) {
 			s->flags |= MTA_FREE;
 			break;
 		}
@@ -839,7 +1132,9 @@ mta_enter_state(struct mta_session *s, int newstate)
 		break;
 
 	case MTA_EOM:
-		mta_send(s, ".");
+		/* the last BDAT chunk already ended the message */
+		if (!(s->ext & MTA_EXT_CHUNKING))
+			mta_send(s, ".");
 		break;
 
 	case MTA_LMTP_EOM:
@@ -876,9 +1171,14 @@ mta_response(struct mta_session *s, char *line)
 	struct sockaddr		*sa;
 	const char		*domain;
 	socklen_t		 sa_len;
+	struct timespec		 now;
 	char			 buf[LINE_MAX];
 	int			 delivery;
 
+	/* the remote host is deferring or rejecting us */
+	if (line[0] == '4' || line[0] == '5')
+		mta_route_feedback(s->relay, s->route, line, -1);
+
 	switch (s->state) {
 
 	case MTA_BANNER:
@@ -1003,6 +1303,7 @@ mta_response(struct mta_session *s, char *line)
 		}
 
 		s->currevp = TAILQ_NEXT(s->currevp, entry);
+		s->rcptwait--;
 		if (line[0] == '2') {
 			s->failures = 0;
 			/*
@@ -1083,12 +1384,45 @@ mta_response(struct mta_session *s, char *line)
 		mta_enter_state(s, MTA_RSET);
 		break;
 
+	case MTA_BODY:
+		/* reply to a chunk, when BDAT is not pipelined */
+		s->chunkwait--;
+		if (line[0] == '2') {
+			mta_enter_state(s, MTA_BODY);
+			break;
+		}
+		if (line[0] == '5')
+			delivery = IMSG_MTA_DELIVERY_PERMFAIL;
+		else
+			delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
+		mta_flush_task(s, delivery, line, 0, 0);
+		mta_enter_state(s, MTA_RSET);
+		break;
+
 	case MTA_LMTP_EOM:
 	case MTA_EOM:
+		if (s->chunkwait && --s->chunkwait) {
+			/* reply to a chunk other than the last one */
+			if (line[0] == '2') {
+				memset(s->replybuf, 0, sizeof s->replybuf);
+				break;
+			}
+			if (line[0] == '5')
+				delivery = IMSG_MTA_DELIVERY_PERMFAIL;
+			else
+				delivery = IMSG_MTA_DELIVERY_TEMPFAIL;
+			mta_flush_task(s, delivery, line, 0, 0);
+			mta_enter_state(s, MTA_RSET);
+			break;
+		}
 		if (line[0] == '2') {
 			delivery = IMSG_MTA_DELIVERY_OK;
 			s->msgtried = 0;
 			s->msgcount++;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			mta_route_feedback(s->relay, s->route, line,
+			    (now.tv_sec - s->txstart.tv_sec) * 1000 +
+			    (now.tv_nsec - s->txstart.tv_nsec) / 1000000);
 		}
 		else if (line[0] == '5')
 			delivery = IMSG_MTA_DELIVERY_PERMFAIL;
@@ -1151,8 +1485,12 @@ mta_io(struct io *io, int evt, void *arg)
 	case IO_CONNECTED:
 		log_info("%016"PRIx64" mta event=connected", s->id);
 
+		evtimer_del(&s->ev);
+		mta_race_won(s);
+
 		if (s->use_smtps) {
 			io_set_write(io);
+			mta_stage(s, MTA_STAGE_TLS);
 			mta_start_tls(s);
 		}
 		else {
@@ -1166,6 +1504,14 @@ mta_io(struct io *io, int evt, void *arg)
 		    s->id, ssl_to_text(io_ssl(&s->io)));
 		s->flags |= MTA_TLS;
 
+		stat_increment("mta.tls.handshake", 1);
+		if (SSL_session_reused(io_ssl(&s->io)))
+			stat_increment("mta.tls.resumed", 1);
+		else
+			mta_tls_save_session(s);
+		if (ssl_ktls_active(io_ssl(&s->io)))
+			stat_increment("mta.tls.ktls", 1);
+
 		if (mta_verify_certificate(s)) {
 			io_pause(&s->io, IO_PAUSE_IN);
 			break;
@@ -1208,6 +1554,8 @@ mta_io(struct io *io, int evt, void *arg)
 			}
 			else if (strcmp(msg, "PIPELINING") == 0)
 				s->ext |= MTA_EXT_PIPELINING;
+			else if (strcmp(msg, "CHUNKING") == 0)
+				s->ext |= MTA_EXT_CHUNKING;
 			else if (strcmp(msg, "DSN") == 0)
 				s->ext |= MTA_EXT_DSN;
 		}
@@ -1243,6 +1591,13 @@ mta_io(struct io *io, int evt, void *arg)
 		else
 			(void)strlcpy(s->replybuf, line, sizeof s->replybuf);
 
+		if (s->skipreplies) {
+			/* pipelined command of a transaction already flushed */
+			s->skipreplies--;
+			memset(s->replybuf, 0, sizeof s->replybuf);
+			goto nextline;
+		}
+
 		if (s->state == MTA_QUIT) {
 			log_info("%016"PRIx64" mta event=closed reason=quit messages=%zu",
 			    s->id, s->msgcount);
@@ -1261,6 +1616,18 @@ mta_io(struct io *io, int evt, void *arg)
 			return;
 		}
 
+		/*
+		 * More replies to pipelined commands are due.  If nothing
+		 * was queued, keep reading, otherwise resume on IO_LOWAT.
+		 */
+		if (s->rcptwait || s->chunkwait || s->skipreplies) {
+			if (io_queued(&s->io) == 0) {
+				io_set_read(io);
+				goto nextline;
+			}
+			break;
+		}
+
 		if (io_datalen(&s->io)) {
 			log_debug("debug: mta: remaining data in input buffer");
 			mta_error(s, "Remote host sent too much data");
@@ -1280,12 +1647,17 @@ mta_io(struct io *io, int evt, void *arg)
 			}
 		}
 
-		if (io_queued(&s->io) == 0)
+		if (io_queued(&s->io) == 0) {
 			io_set_read(io);
+			/* pipelined replies may already be buffered */
+			if (io_datalen(&s->io))
+				goto nextline;
+		}
 		break;
 
 	case IO_TIMEOUT:
 		log_debug("debug: mta: %p: connection timeout", s);
+		mta_route_feedback(s->relay, s->route, NULL, -1);
 		mta_error(s, "Connection timeout");
 		if (!s->ready)
 			mta_connect(s);
@@ -1366,6 +1738,35 @@ mta_send(struct mta_session *s, char *fmt, ...)
 	free(p);
 }
 
+/*
+ * Send RCPT for the envelopes not submitted yet.  With PIPELINING,
+ * up to MTA_RCPT_WINDOW commands are in flight, otherwise only one.
+ */
+static void
+mta_send_rcpt(struct mta_session *s)
+{
+	struct mta_envelope	*e;
+	size_t			 window;
+
+	window = (s->ext & MTA_EXT_PIPELINING) ? MTA_RCPT_WINDOW : 1;
+
+	while (s->rcptwait < window && (e = s->nextevp) != NULL) {
+		if (s->ext & MTA_EXT_DSN) {
+			mta_send(s, "RCPT TO:<%s>%s%s%s%s",
+			    e->dest,
+			    e->dsn_notify ? " NOTIFY=" : "",
+			    e->dsn_notify ? dsn_strnotify(e->dsn_notify) : "",
+			    e->dsn_orcpt ? " ORCPT=" : "",
+			    e->dsn_orcpt ? e->dsn_orcpt : "");
+		} else
+			mta_send(s, "RCPT TO:<%s>", e->dest);
+
+		s->nextevp = TAILQ_NEXT(e, entry);
+		s->rcptwait++;
+		s->rcptcount++;
+	}
+}
+
 /*
  * Queue some data into the input buffer
  */
@@ -1401,6 +1802,59 @@ mta_queue_data(struct mta_session *s)
 	return (io_queued(&s->io) - q);
 }
 
+/*
+ * Queue the next BDAT chunk.  Lines get their CRLF back but are not
+ * dot-stuffed, and the chunk is flagged LAST at the end of the file.
+ */
+static ssize_t
+mta_queue_chunk(struct mta_session *s)
+{
+	char	*ln = NULL, *p;
+	size_t	 sz = 0, len, q;
+	ssize_t	 n;
+	int	 last;
+
+	q = io_queued(&s->io);
+
+	len = 0;
+	while (len < MTA_CHUNK_SIZE) {
+		if ((n = getline(&ln, &sz, s->datafp)) == -1)
+			break;
+		if (ln[n - 1] == '\n')
+			n--;
+		if (len + n + 2 > s->chunksz) {
+			if ((p = reallocarray(s->chunk, 2,
+			    len + n + 2)) == NULL)
+				fatal("mta_queue_chunk: reallocarray");
+			s->chunk = p;
+			s->chunksz = 2 * (len + n + 2);
+		}
+		memcpy(s->chunk + len, ln, n);
+		memcpy(s->chunk + len + n, "\r\n", 2);
+		len += n + 2;
+	}
+
+	free(ln);
+	if (ferror(s->datafp)) {
+		mta_flush_task(s, IMSG_MTA_DELIVERY_TEMPFAIL,
+		    "Error reading content file", 0, 0);
+		return (-1);
+	}
+
+	last = feof(s->datafp);
+	mta_send(s, "BDAT %zu%s", len, last ? " LAST" : "");
+	if (len && io_write(&s->io, s->chunk, len) == -1)
+		fatal("mta_queue_chunk: io_write");
+	s->chunkwait++;
+
+	if (last) {
+		fclose(s->datafp);
+		s->datafp = NULL;
+	}
+
+	return (io_queued(&s->io) - q);
+}
+
 static void
 mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t count,
 	int cache)
@@ -1458,6 +1912,11 @@ mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t co
 	free(s->task);
 	s->task = NULL;
 
+	/* replies to commands still in flight are of no use now */
+	s->skipreplies += s->rcptwait + s->chunkwait;
+	s->rcptwait = s->chunkwait = 0;
+	s->nextevp = NULL;
+
 	if (s->datafp) {
 		fclose(s->datafp);
 		s->datafp = NULL;
@@ -1676,6 +2135,32 @@ mta_tls_verified(struct mta_session *s)
 		mta_enter_state(s, MTA_EHLO);
 }
 
+/*
+ * Offer the last TLS session negotiated on this route, so that repeated
+ * deliveries to the same host can skip the full handshake.  Sessions are
+ * not cached when the relay presents a client certificate.
+ */
+static void
+mta_tls_resume(struct mta_session *s, void *ssl)
+{
+	if (s->relay->pki_name == NULL && s->route->tls_session)
+		SSL_set_session(ssl, s->route->tls_session);
+}
+
+static void
+mta_tls_save_session(struct mta_session *s)
+{
+	SSL_SESSION	*session;
+
+	if (s->relay->pki_name)
+		return;
+	if ((session = SSL_get1_session(io_ssl(&s->io))) == NULL)
+		return;
+	if (s->route->tls_session)
+		SSL_SESSION_free(s->route->tls_session);
+	s->route->tls_session = session;
+}
+
 static const char *
 dsn_strret(enum dsn_ret ret)
 {
@@ -1716,6 +2201,106 @@ dsn_strnotify(uint8_t arg)
 	return (buf);
 }
 
+/*
+ * Account the time spent in the current stage of the session, and
+ * enter the new one.
+ */
+static void
+mta_stage(struct mta_session *s, enum mta_stage stage)
+{
+	struct mta_latency	*l;
+	struct timespec		 now;
+	struct timeval		 tv;
+	const char		*name;
+	int64_t			 msecs;
+	int			 i;
+
+	if (stage == s->stage)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (s->stage != MTA_STAGE_NONE) {
+		msecs = (now.tv_sec - s->tstage.tv_sec) * 1000 +
+		    (now.tv_nsec - s->tstage.tv_nsec) / 1000000;
+		for (i = 0; i < MTA_LATENCY_BUCKETS - 1; i++)
+			if (msecs < (1 << i))
+				break;
+
+		latency.hist[s->stage][i]++;
+
+		/*
+		 * Every stat key lives for good in the control process,
+		 * so only the first domains get per-relay histograms.
+		 */
+		name = s->relay->domain->name;
+		l = dict_get(&latency_relays, name);
+		if (l == NULL && !dict_check(&latency_domains, name) &&
+		    dict_count(&latency_domains) < MTA_LATENCY_MAXRELAY)
+			dict_xset(&latency_domains, name, NULL);
+		if (l == NULL && dict_check(&latency_domains, name)) {
+			l = xcalloc(1, sizeof *l, "mta_stage");
+			dict_xset(&latency_relays, name, l);
+		}
+		if (l)
+			l->hist[s->stage][i]++;
+
+		if (!evtimer_pending(&ev_latency, NULL)) {
+			tv.tv_sec = MTA_LATENCY_FLUSH;
+			tv.tv_usec = 0;
+			evtimer_add(&ev_latency, &tv);
+		}
+	}
+
+	s->stage = stage;
+	s->tstage = now;
+}
+
+static void
+mta_latency_report(const char *prefix, struct mta_latency *l)
+{
+	char	key[STAT_KEY_SIZE];
+	int	stage, i;
+
+	for (stage = MTA_STAGE_NONE + 1; stage < MTA_STAGE_MAX; stage++)
+		for (i = 0; i < MTA_LATENCY_BUCKETS; i++) {
+			if (l->hist[stage][i] == 0)
+				continue;
+			if (i < MTA_LATENCY_BUCKETS - 1)
+				(void)snprintf(key, sizeof key,
+				    "%s.%s.lt%05dms", prefix,
+				    mta_stages[stage], 1 << i);
+			else
+				(void)snprintf(key, sizeof key,
+				    "%s.%s.inf", prefix, mta_stages[stage]);
+			stat_increment(key, l->hist[stage][i]);
+			l->hist[stage][i] = 0;
+		}
+}
+
+/*
+ * The histograms are accumulated locally and pushed to the stat
+ * backend periodically, rather than once per event.
+ */
+static void
+mta_latency_flush(int fd, short event, void *arg)
+{
+	struct mta_latency	*l;
+	const char		*name;
+	void			*iter;
+	char			 prefix[STAT_KEY_SIZE];
+
+	mta_latency_report("mta.latency", &latency);
+
+	iter = NULL;
+	while (dict_iter(&latency_relays, &iter, &name, (void **)&l)) {
+		(void)snprintf(prefix, sizeof prefix,
+		    "mta.latency.relay.%s", name);
+		mta_latency_report(prefix, l);
+	}
+	while (dict_poproot(&latency_relays, (void **)&l))
+		free(l);
+}
+
 #define CASE(x) case x : return #x
 
 static const char *
@@ -104,6 +104,10 @@ static int		 errors = 0;
 static uint64_t		 ruleid = 0;
 
 struct filter_conf	*filter = NULL;
+static struct filter_opts {
+	int		parallel;
+	time_t		cachettl;
+} filter_opts;
 struct table		*table = NULL;
 struct rule		*rule = NULL;
 struct mta_limits	*limits;
@@ -187,6 +191,7 @@ typedef struct {
 %token	ARROW AUTH TLS LOCAL VIRTUAL TAG TAGGED ALIAS FILTER KEY CA DHE
 %token	AUTH_OPTIONAL TLS_REQUIRE USERBASE SENDER SENDERS MASK_SOURCE VERIFY FORWARDONLY RECIPIENT
 %token	CIPHERS RECEIVEDAUTH MASQUERADE SOCKET SUBADDRESSING_DELIM AUTHENTICATED
+%token	KTLS WORKERS PARALLEL CACHE
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
 %type	<v.table>	table
@@ -345,6 +350,34 @@ opt_limit_session : STRING NUMBER {
 			else if (!strcmp($1, "max-mails")) {
 				conf->sc_session_max_mails = $2;
 			}
+			else if (!strcmp($1, "accept-batch")) {
+				if ($2 < 1) {
+					yyerror("invalid session accept-batch: "
+					    "%" PRId64, $2);
+					free($1);
+					YYERROR;
+				}
+				conf->sc_session_accept_batch = $2;
+			}
+			else if (!strcmp($1, "max-per-source") ||
+			    !strcmp($1, "max-per-netblock") ||
+			    !strcmp($1, "rate-per-source") ||
+			    !strcmp($1, "rate-per-netblock")) {
+				if ($2 < 0) {
+					yyerror("invalid session %s: %" PRId64,
+					    $1, $2);
+					free($1);
+					YYERROR;
+				}
+				if (!strcmp($1, "max-per-source"))
+					conf->sc_session_max_per_source = $2;
+				else if (!strcmp($1, "max-per-netblock"))
+					conf->sc_session_max_per_netblock = $2;
+				else if (!strcmp($1, "rate-per-source"))
+					conf->sc_session_rate_per_source = $2;
+				else
+					conf->sc_session_rate_per_netblock = $2;
+			}
 			else {
 				yyerror("invalid session limit keyword: %s", $1);
 				free($1);
@@ -906,6 +939,18 @@ main		: BOUNCEWARN {
 		| MAXMTADEFERRED NUMBER  {
 			conf->sc_mta_max_deferred = $2;
 		}
+		| KTLS {
+			conf->sc_tls_ktls = 1;
+		}
+		| WORKERS NUMBER {
+			if ($2 < 1 || $2 > PONY_WORKERS_MAX) {
+				yyerror("invalid number of workers: %" PRId64
+				    " (must be between 1 and %d)",
+				    $2, PONY_WORKERS_MAX);
+				YYERROR;
+			}
+			conf->sc_pony_workers = $2;
+		}
 		| LIMIT SESSION limits_session
 		| LIMIT MDA limits_mda
 		| LIMIT MTA FOR DOMAIN STRING {
@@ -945,6 +990,23 @@ main		: BOUNCEWARN {
 				}
 			}
 		} filter_args
+		| FILTER STRING {
+			memset(&filter_opts, 0, sizeof filter_opts);
+		} filter_opts STRING {
+			if (!strcmp($5, "chain")) {
+				yyerror("filter chain \"%s\" cannot take options", $2);
+				free($2);
+				free($5);
+				YYERROR;
+			}
+			if ((filter = create_filter_proc($2, $5)) == NULL) {
+				free($2);
+				free($5);
+				YYERROR;
+			}
+			filter->parallel = filter_opts.parallel;
+			filter->cachettl = filter_opts.cachettl;
+		} filter_args
 		| PKI STRING	{
 			char buf[HOST_NAME_MAX+1];
 
@@ -990,6 +1052,24 @@ main		: BOUNCEWARN {
 		}
 		;
 
+filter_opt	: PARALLEL {
+			filter_opts.parallel = 1;
+		}
+		| CACHE STRING {
+			filter_opts.cachettl = delaytonum($2);
+			if (filter_opts.cachettl <= 0) {
+				yyerror("invalid filter cache delay: %s", $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+		}
+		;
+
+filter_opts	: filter_opt
+		| filter_opt filter_opts
+		;
+
 filter_args	:
 		| STRING {
 			if (!add_filter_arg(filter, $1)) {
@@ -1507,6 +1587,7 @@ lookup(char *s)
 		{ "backup",		BACKUP },
 		{ "bounce-warn",	BOUNCEWARN },
 		{ "ca",			CA },
+		{ "cache",		CACHE },
 		{ "certificate",	CERTIFICATE },
 		{ "ciphers",		CIPHERS },
 		{ "compression",	COMPRESSION },
@@ -1525,6 +1606,7 @@ lookup(char *s)
 		{ "inet4",		INET4 },
 		{ "inet6",		INET6 },
 		{ "key",		KEY },
+		{ "ktls",		KTLS },
 		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
 		{ "lmtp",		LMTP },
@@ -1539,6 +1621,7 @@ lookup(char *s)
 		{ "mta",		MTA },
 		{ "no-dsn",		NODSN },
 		{ "on",			ON },
+		{ "parallel",		PARALLEL },
 		{ "pki",		PKI },
 		{ "port",		PORT },
 		{ "queue",		QUEUE },
@@ -1566,6 +1649,7 @@ lookup(char *s)
 		{ "verify",		VERIFY },
 		{ "via",		VIA },
 		{ "virtual",		VIRTUAL },
+		{ "workers",		WORKERS },
 	};
 	const struct keywords	*p;
 
@@ -1972,6 +2056,8 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 	
 	conf->sc_session_max_rcpt = 1000;
 	conf->sc_session_max_mails = 100;
+	conf->sc_session_accept_batch = 1;
+	conf->sc_pony_workers = 1;
 
 	conf->sc_mda_max_session = 50;
 	conf->sc_mda_max_user_session = 7;
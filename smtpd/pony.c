@@ -85,6 +85,7 @@ pony_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_SMTP_AUTHENTICATE:
 	case IMSG_SMTP_TLS_INIT:
 	case IMSG_SMTP_TLS_VERIFY:
+	case IMSG_SMTP_TLS_TICKET_KEY:
 	case IMSG_SMTP_MESSAGE_COMMIT:
 	case IMSG_SMTP_MESSAGE_CREATE:
 	case IMSG_SMTP_MESSAGE_OPEN:
@@ -107,6 +108,7 @@ pony_imsg(struct mproc *p, struct imsg *imsg)
 	case IMSG_MTA_DNS_HOST_END:
 	case IMSG_MTA_DNS_MX_PREFERENCE:
 	case IMSG_MTA_DNS_PTR:
+	case IMSG_MTA_HOSTSTATS:
 	case IMSG_MTA_TLS_INIT:
 	case IMSG_MTA_TLS_VERIFY:
 	case IMSG_CTL_RESUME_ROUTE:
@@ -166,6 +168,10 @@ pony(void)
 		fatal("pony: chdir(\"/\")");
 
 	config_process(PROC_PONY);
+	if (env->sc_pony_workers > 1) {
+		setproctitle("%s [%d]", proc_title(PROC_PONY), pony_worker);
+		generate_uid_worker(pony_worker);
+	}
 
 	if (setgroups(1, &pw->pw_gid) ||
 	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
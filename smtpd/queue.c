@@ -45,12 +45,29 @@
 #include "smtpd.h"
 #include "log.h"
 
+struct open_req {
+	struct mproc	*p;
+	uint32_t	 type;
+	uint64_t	 reqid;
+};
+
 static void queue_imsg(struct mproc *, struct imsg *);
 static void queue_timeout(int, short, void *);
 static void queue_bounce(struct envelope *, struct delivery_bounce *);
 static void queue_shutdown(void);
 static void queue_log(const struct envelope *, const char *, const char *);
 static void queue_msgid_walk(int, short, void *);
+static struct mproc *queue_relay_pony(const struct envelope *);
+static void queue_message_opened(int, void *);
+static void queue_hoststats_load(void);
+static void queue_hoststats_update(struct mta_stats *);
+static void queue_hoststats_save(int, short, void *);
+
+#define	HOSTSTATS_EXPIRE	(30 * 24 * 3600)
+#define	HOSTSTATS_SAVE_DELAY	60
+
+static struct dict	hoststats;
+static struct event	ev_hoststats;
 
 
 static void
@@ -58,8 +75,10 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 {
 	struct delivery_bounce	 bounce;
 	struct msg_walkinfo	*wi;
+	struct mproc		*p_session;
 	struct timeval		 tv;
 	struct bounce_req_msg	*req_bounce;
+	struct open_req		*req_open;
 	struct envelope		 evp;
 	struct msg		 m;
 	const char		*reason;
@@ -162,15 +181,16 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 				log_warnx("warn: imsg_queue_submit_envelope: msgid=0, "
 				    "evpid=%016"PRIx64, evp.id);
 			ret = queue_envelope_create(&evp);
-			m_create(p_pony, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
-			m_add_id(p_pony, reqid);
+			p_session = pony_by_id(reqid);
+			m_create(p_session, IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
+			m_add_id(p_session, reqid);
 			if (ret == 0)
-				m_add_int(p_pony, 0);
+				m_add_int(p_session, 0);
 			else {
-				m_add_int(p_pony, 1);
-				m_add_evpid(p_pony, evp.id);
+				m_add_int(p_session, 1);
+				m_add_evpid(p_session, evp.id);
 			}
-			m_close(p_pony);
+			m_close(p_session);
 			if (ret) {
 				m_create(p_scheduler,
 				    IMSG_QUEUE_ENVELOPE_SUBMIT, 0, 0, -1);
@@ -184,10 +204,11 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_end(&m);
-			m_create(p_pony, IMSG_QUEUE_ENVELOPE_COMMIT, 0, 0, -1);
-			m_add_id(p_pony, reqid);
-			m_add_int(p_pony, 1);
-			m_close(p_pony);
+			p_session = pony_by_id(reqid);
+			m_create(p_session, IMSG_QUEUE_ENVELOPE_COMMIT, 0, 0, -1);
+			m_add_id(p_session, reqid);
+			m_add_int(p_session, 1);
+			m_close(p_session);
 			return;
 		}
 	}
@@ -265,9 +286,10 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 				return;
 			}
 			evp.lasttry = time(NULL);
-			m_create(p_pony, IMSG_QUEUE_DELIVER, 0, 0, -1);
-			m_add_envelope(p_pony, &evp);
-			m_close(p_pony);
+			p_session = pony_by_key(evp.agent.mda.username);
+			m_create(p_session, IMSG_QUEUE_DELIVER, 0, 0, -1);
+			m_add_envelope(p_session, &evp);
+			m_close(p_session);
 			return;
 
 		case IMSG_SCHED_ENVELOPE_INJECT:
@@ -290,9 +312,10 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 				return;
 			}
 			evp.lasttry = time(NULL);
-			m_create(p_pony, IMSG_QUEUE_TRANSFER, 0, 0, -1);
-			m_add_envelope(p_pony, &evp);
-			m_close(p_pony);
+			p_session = queue_relay_pony(&evp);
+			m_create(p_session, IMSG_QUEUE_TRANSFER, 0, 0, -1);
+			m_add_envelope(p_session, &evp);
+			m_close(p_session);
 			return;
 
 		case IMSG_CTL_LIST_ENVELOPES:
@@ -342,10 +365,12 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_id(&m, &reqid);
 			m_get_msgid(&m, &msgid);
 			m_end(&m);
-			fd = queue_message_fd_r(msgid);
-			m_create(p, imsg->hdr.type, 0, 0, fd);
-			m_add_id(p, reqid);
-			m_close(p);
+			req_open = xcalloc(1, sizeof *req_open, "queue_imsg");
+			req_open->p = p;
+			req_open->type = imsg->hdr.type;
+			req_open->reqid = reqid;
+			queue_message_fd_r_async(msgid, queue_message_opened,
+			    req_open);
 			return;
 
 		case IMSG_MDA_DELIVERY_OK:
@@ -464,6 +489,13 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_forward(p_scheduler, imsg);
 			return;
 
+		case IMSG_MTA_HOSTSTATS:
+			if (imsg->hdr.len - IMSG_HEADER_SIZE !=
+			    sizeof(struct mta_stats))
+				fatalx("queue_imsg: bad hoststats size");
+			queue_hoststats_update(imsg->data);
+			return;
+
 		case IMSG_MTA_HOLDQ_RELEASE:
 		case IMSG_MDA_HOLDQ_RELEASE:
 			m_msg(&m, imsg);
@@ -702,6 +734,8 @@ queue(void)
 	config_peer(PROC_SCHEDULER);
 	config_peer(PROC_PONY);
 
+	queue_hoststats_load();
+
 	/* setup queue loading task */
 	evtimer_set(&ev_qload, queue_timeout, &ev_qload);
 	tv.tv_sec = 0;
@@ -717,6 +751,148 @@ queue(void)
 	return (0);
 }
 
+static void
+queue_message_opened(int fd, void *arg)
+{
+	struct open_req	*req = arg;
+
+	m_create(req->p, req->type, 0, 0, fd);
+	m_add_id(req->p, req->reqid);
+	m_close(req->p);
+	free(req);
+}
+
+/*
+ * Delivery statistics collected by the mta are saved in the spool, and
+ * handed back to every pony worker at startup.
+ */
+static void
+queue_hoststats_load(void)
+{
+	struct mta_stats	 st, *s;
+	FILE			*fp;
+	uint32_t		 hdr[2];
+	void			*iter;
+	time_t			 now;
+	int			 i;
+
+	dict_init(&hoststats);
+	evtimer_set(&ev_hoststats, queue_hoststats_save, NULL);
+
+	if ((fp = fopen(PATH_HOSTSTATS, "r")) == NULL) {
+		if (errno != ENOENT)
+			log_warn("warn: queue: %s", PATH_HOSTSTATS);
+		return;
+	}
+
+	if (fread(hdr, sizeof hdr, 1, fp) != 1 ||
+	    hdr[0] != MTA_STATS_VERSION || hdr[1] != sizeof st) {
+		log_warnx("warn: queue: ignoring stale %s", PATH_HOSTSTATS);
+		fclose(fp);
+		return;
+	}
+
+	now = time(NULL);
+	while (fread(&st, sizeof st, 1, fp) == 1) {
+		if (st.tm + HOSTSTATS_EXPIRE < now)
+			continue;
+		st.name[sizeof(st.name) - 1] = '\0';
+		s = xmemdup(&st, sizeof st, "queue_hoststats_load");
+		dict_set(&hoststats, s->name, s);
+	}
+	fclose(fp);
+
+	log_debug("debug: queue: loaded %zu host statistics",
+	    dict_count(&hoststats));
+
+	iter = NULL;
+	while (dict_iter(&hoststats, &iter, NULL, (void **)&s))
+		for (i = 0; i < env->sc_pony_workers; i++)
+			m_compose(p_ponies[i], IMSG_MTA_HOSTSTATS, 0, 0, -1,
+			    s, sizeof *s);
+}
+
+static void
+queue_hoststats_update(struct mta_stats *st)
+{
+	struct mta_stats	*s;
+	struct timeval		 tv;
+
+	st->name[sizeof(st->name) - 1] = '\0';
+	st->last4xx[sizeof(st->last4xx) - 1] = '\0';
+	st->last5xx[sizeof(st->last5xx) - 1] = '\0';
+
+	/* updates carry the counts added by a pony worker since the last one */
+	if ((s = dict_get(&hoststats, st->name)) == NULL) {
+		s = xmemdup(st, sizeof *st, "queue_hoststats_update");
+		dict_set(&hoststats, s->name, s);
+	}
+	else
+		mta_stats_merge(s, st);
+
+	if (!evtimer_pending(&ev_hoststats, NULL)) {
+		tv.tv_sec = HOSTSTATS_SAVE_DELAY;
+		tv.tv_usec = 0;
+		evtimer_add(&ev_hoststats, &tv);
+	}
+}
+
+static void
+queue_hoststats_save(int fd, short event, void *arg)
+{
+	struct mta_stats	*s;
+	FILE			*fp;
+	uint32_t		 hdr[2];
+	void			*iter;
+
+	if ((fp = fopen(PATH_HOSTSTATS ".tmp", "w")) == NULL) {
+		log_warn("warn: queue: %s.tmp", PATH_HOSTSTATS);
+		return;
+	}
+
+	hdr[0] = MTA_STATS_VERSION;
+	hdr[1] = sizeof *s;
+	if (fwrite(hdr, sizeof hdr, 1, fp) != 1)
+		goto fail;
+
+	iter = NULL;
+	while (dict_iter(&hoststats, &iter, NULL, (void **)&s))
+		if (fwrite(s, sizeof *s, 1, fp) != 1)
+			goto fail;
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+		goto fail;
+	if (fclose(fp) == EOF) {
+		fp = NULL;
+		goto fail;
+	}
+	if (rename(PATH_HOSTSTATS ".tmp", PATH_HOSTSTATS) == -1) {
+		fp = NULL;
+		goto fail;
+	}
+	return;
+
+fail:
+	log_warn("warn: queue: failed to save %s", PATH_HOSTSTATS);
+	if (fp)
+		fclose(fp);
+	unlink(PATH_HOSTSTATS ".tmp");
+}
+
+/*
+ * All envelopes going through the same relay must reach the same pony
+ * worker, which owns the MTA relay, route and host state for it.
+ */
+static struct mproc *
+queue_relay_pony(const struct envelope *evp)
+{
+	if (evp->agent.mta.relay.hostname[0] &&
+	    !(evp->agent.mta.relay.flags & RELAY_BACKUP))
+		return (pony_by_key(evp->agent.mta.relay.hostname));
+
+	return (pony_by_key(evp->dest.domain));
+}
+
 static void
 queue_timeout(int fd, short event, void *p)
 {
@@ -34,13 +34,17 @@
 #include <limits.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <openssl/crypto.h>
+
 #include "smtpd.h"
 #include "log.h"
 
@@ -54,6 +58,44 @@ extern struct queue_backend	queue_backend_ram;
 static void queue_envelope_cache_add(struct envelope *);
 static void queue_envelope_cache_update(struct envelope *);
 static void queue_envelope_cache_del(uint64_t evpid);
+static int queue_message_decode(int);
+static void queue_decode_init(void);
+static void *queue_decode_worker(void *);
+static void queue_decode_done(int, short, void *);
+
+/*
+ * Older libcrypto versions are only safe to use from several threads
+ * if the application provides the locking primitives.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+#define	QUEUE_DECODE_LOCKING
+static void queue_decode_crypto_lock(int, int, const char *, int);
+static void queue_decode_crypto_threadid(CRYPTO_THREADID *);
+static pthread_mutex_t *decoder_crypto_locks;
+#endif
+
+/*
+ * Decrypting and uncompressing a message can take a while: it is done
+ * by a pool of threads so that the queue keeps serving other requests.
+ */
+#define	QUEUE_DECODE_WORKERS	4
+
+struct queue_decode_job {
+	TAILQ_ENTRY(queue_decode_job)	 entry;
+	int				 fd;
+	void				(*cb)(int, void *);
+	void				*arg;
+};
+
+static struct {
+	int				 init;
+	pthread_mutex_t			 lock;
+	pthread_cond_t			 cond;
+	TAILQ_HEAD(, queue_decode_job)	 pending;
+	TAILQ_HEAD(, queue_decode_job)	 done;
+	int				 pipe[2];
+	struct event			 ev;
+} decoder;
 
 TAILQ_HEAD(evplst, envelope);
 
@@ -149,6 +191,8 @@ queue_init(const char *name, int server)
 			errx(1, "error in offline directory setup");
 		if (ckdir(PATH_SPOOL PATH_PURGE, 0700, pwq->pw_uid, 0, 1) == 0)
 			errx(1, "error in purge directory setup");
+		if (ckdir(PATH_SPOOL PATH_STATS, 0700, pwq->pw_uid, 0, 1) == 0)
+			errx(1, "error in stats directory setup");
 
 		mvpurge(PATH_SPOOL PATH_TEMPORARY, PATH_SPOOL PATH_PURGE);
 
@@ -324,9 +368,7 @@ queue_message_uncorrupt(uint32_t msgid)
 int
 queue_message_fd_r(uint32_t msgid)
 {
-	int	fdin = -1, fdout = -1, fd = -1;
-	FILE	*ifp = NULL;
-	FILE	*ofp = NULL;
+	int	fdin;
 
 	profile_enter("queue_message_fd_r");
 	fdin = handler_message_fd_r(msgid);
@@ -338,6 +380,169 @@ queue_message_fd_r(uint32_t msgid)
 	if (fdin == -1)
 		return (-1);
 
+	return (queue_message_decode(fdin));
+}
+
+/*
+ * Same as queue_message_fd_r(), but the callback is called with the fd
+ * once the message is ready, possibly later from the event loop.
+ */
+void
+queue_message_fd_r_async(uint32_t msgid, void (*cb)(int, void *), void *arg)
+{
+	struct queue_decode_job	*job;
+	int			 fdin;
+
+	if (!(env->sc_queue_flags & (QUEUE_COMPRESSION|QUEUE_ENCRYPTION))) {
+		cb(queue_message_fd_r(msgid), arg);
+		return;
+	}
+
+	profile_enter("queue_message_fd_r");
+	fdin = handler_message_fd_r(msgid);
+	profile_leave();
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_message_fd_r_async(%08"PRIx32") -> %d",
+	    msgid, fdin);
+
+	if (fdin == -1) {
+		cb(-1, arg);
+		return;
+	}
+
+	if (!decoder.init)
+		queue_decode_init();
+
+	job = xcalloc(1, sizeof *job, "queue_message_fd_r_async");
+	job->fd = fdin;
+	job->cb = cb;
+	job->arg = arg;
+
+	pthread_mutex_lock(&decoder.lock);
+	TAILQ_INSERT_TAIL(&decoder.pending, job, entry);
+	pthread_cond_signal(&decoder.cond);
+	pthread_mutex_unlock(&decoder.lock);
+}
+
+static void
+queue_decode_init(void)
+{
+	pthread_t	t;
+	sigset_t	set, oset;
+	int		i;
+
+#ifdef QUEUE_DECODE_LOCKING
+	if (CRYPTO_get_locking_callback() == NULL) {
+		decoder_crypto_locks = xcalloc(CRYPTO_num_locks(),
+		    sizeof *decoder_crypto_locks, "queue_decode_init");
+		for (i = 0; i < CRYPTO_num_locks(); i++)
+			pthread_mutex_init(&decoder_crypto_locks[i], NULL);
+		CRYPTO_THREADID_set_callback(queue_decode_crypto_threadid);
+		CRYPTO_set_locking_callback(queue_decode_crypto_lock);
+	}
+#endif
+
+	pthread_mutex_init(&decoder.lock, NULL);
+	pthread_cond_init(&decoder.cond, NULL);
+	TAILQ_INIT(&decoder.pending);
+	TAILQ_INIT(&decoder.done);
+
+	if (pipe(decoder.pipe) == -1)
+		fatal("queue_decode_init: pipe");
+	io_set_nonblocking(decoder.pipe[0]);
+	event_set(&decoder.ev, decoder.pipe[0], EV_READ|EV_PERSIST,
+	    queue_decode_done, NULL);
+	event_add(&decoder.ev, NULL);
+
+	/* signals must keep being delivered to the event loop */
+	sigfillset(&set);
+	if (pthread_sigmask(SIG_BLOCK, &set, &oset))
+		fatalx("queue_decode_init: pthread_sigmask");
+	for (i = 0; i < QUEUE_DECODE_WORKERS; i++) {
+		if (pthread_create(&t, NULL, queue_decode_worker, NULL))
+			fatalx("queue_decode_init: pthread_create");
+		pthread_detach(t);
+	}
+	if (pthread_sigmask(SIG_SETMASK, &oset, NULL))
+		fatalx("queue_decode_init: pthread_sigmask");
+	decoder.init = 1;
+}
+
+#ifdef QUEUE_DECODE_LOCKING
+static void
+queue_decode_crypto_lock(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&decoder_crypto_locks[n]);
+	else
+		pthread_mutex_unlock(&decoder_crypto_locks[n]);
+}
+
+static void
+queue_decode_crypto_threadid(CRYPTO_THREADID *id)
+{
+	CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
+#endif
+
+static void *
+queue_decode_worker(void *arg)
+{
+	struct queue_decode_job	*job;
+
+	for (;;) {
+		pthread_mutex_lock(&decoder.lock);
+		while ((job = TAILQ_FIRST(&decoder.pending)) == NULL)
+			pthread_cond_wait(&decoder.cond, &decoder.lock);
+		TAILQ_REMOVE(&decoder.pending, job, entry);
+		pthread_mutex_unlock(&decoder.lock);
+
+		job->fd = queue_message_decode(job->fd);
+
+		pthread_mutex_lock(&decoder.lock);
+		TAILQ_INSERT_TAIL(&decoder.done, job, entry);
+		pthread_mutex_unlock(&decoder.lock);
+
+		/* wake up the event loop */
+		(void)write(decoder.pipe[1], "", 1);
+	}
+
+	return (NULL);
+}
+
+static void
+queue_decode_done(int fd, short event, void *arg)
+{
+	struct queue_decode_job	*job;
+	char			 buf[64];
+
+	while (read(fd, buf, sizeof buf) > 0)
+		;
+
+	for (;;) {
+		pthread_mutex_lock(&decoder.lock);
+		if ((job = TAILQ_FIRST(&decoder.done)))
+			TAILQ_REMOVE(&decoder.done, job, entry);
+		pthread_mutex_unlock(&decoder.lock);
+		if (job == NULL)
+			break;
+		job->cb(job->fd, job->arg);
+		free(job);
+	}
+}
+
+/*
+ * Turn the message file into plain text, decrypting and uncompressing
+ * it if needed.  This may run outside of the main thread.
+ */
+static int
+queue_message_decode(int fdin)
+{
+	int	fdout = -1, fd = -1;
+	FILE	*ifp = NULL;
+	FILE	*ofp = NULL;
+
 #ifdef HAVE_GCM_CRYPTO
 	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
 		if ((fdout = mktmpfile()) == -1)
@@ -35,14 +35,32 @@
 static void hdr_dflt_cb(const struct rfc2822_header *hdr, void *arg) {}
 static void body_dflt_cb(const char *line, void *arg) {}
 
+/* case-insensitive FNV-1a, header names are matched without regard to case */
+static uint32_t
+header_hash(const char *name)
+{
+	uint32_t	h = 2166136261U;
+
+	for (; *name; name++) {
+		h ^= (unsigned char)tolower((unsigned char)*name);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Lines of the current header are kept on a per-parser free list once
+ * the header has been dispatched, so that after the first few headers
+ * of a transaction no further allocation takes place.
+ */
 static void
-header_reset(struct rfc2822_header *hdr)
+header_reset(struct rfc2822_parser *rp)
 {
 	struct rfc2822_line	*line;
 
-	while ((line = TAILQ_FIRST(&hdr->lines))) {
-		TAILQ_REMOVE(&hdr->lines, line, next);
-		free(line);
+	while ((line = TAILQ_FIRST(&rp->header.lines))) {
+		TAILQ_REMOVE(&rp->header.lines, line, next);
+		TAILQ_INSERT_HEAD(&rp->lines_free, line, next);
 	}
 }
 
@@ -51,12 +69,16 @@ header_callback(struct rfc2822_parser *rp)
 {
 	struct rfc2822_hdr_cb		*hdr_cb;
 	struct rfc2822_hdr_miss_cb	*hdr_miss_cb;
+	uint32_t			 hash;
+
+	hash = header_hash(rp->header.name);
 
 	if (!rp->in_hdr)
 		goto end;
 
-	TAILQ_FOREACH(hdr_cb, &rp->hdr_cb, next)
-	    if (strcasecmp(hdr_cb->name, rp->header.name) == 0) {
+	TAILQ_FOREACH(hdr_cb, &rp->hdr_cb[hash & (RFC2822_HDR_CB_BUCKETS - 1)], next)
+	    if (hdr_cb->hash == hash &&
+		strcasecmp(hdr_cb->name, rp->header.name) == 0) {
 		    hdr_cb->func(&rp->header, hdr_cb->arg);
 		    goto end;
 	    }
@@ -64,12 +86,13 @@ header_callback(struct rfc2822_parser *rp)
 
 end:
 	TAILQ_FOREACH(hdr_miss_cb, &rp->hdr_miss_cb, next)
-	    if (strcasecmp(hdr_miss_cb->name, rp->header.name) == 0)
+	    if (hdr_miss_cb->hash == hash &&
+		strcasecmp(hdr_miss_cb->name, rp->header.name) == 0)
 		    break;
 	if (hdr_miss_cb)
 		TAILQ_REMOVE(&rp->hdr_miss_cb, hdr_miss_cb, next);
 	free(hdr_miss_cb);
-	header_reset(&rp->header);
+	header_reset(rp);
 	rp->in_hdr = 0;
 	return;
 }
@@ -103,8 +126,8 @@ parser_feed_header(struct rfc2822_parser *rp, char *line)
 		rp->in_hdr = 1;
 		if ((pos = strchr(line, ':')) == NULL)
 			return 0;
-		memset(rp->header.name, 0, sizeof rp->header.name);
 		(void)memcpy(rp->header.name, line, pos - line);
+		rp->header.name[pos - line] = '\0';
 		if (isspace(*(pos + 1)))
 			return parser_feed_header(rp, pos + 1);
 		else {
@@ -117,8 +140,10 @@ parser_feed_header(struct rfc2822_parser *rp, char *line)
 	if (!rp->in_hdr)
 		return 0;
 
-	/* append line to header */
-	if ((hdrline = calloc(1, sizeof *hdrline)) == NULL)
+	/* append line to header, reusing a released line if possible */
+	if ((hdrline = TAILQ_FIRST(&rp->lines_free)) != NULL)
+		TAILQ_REMOVE(&rp->lines_free, hdrline, next);
+	else if ((hdrline = calloc(1, sizeof *hdrline)) == NULL)
 		return -1;
 	(void)strlcpy(hdrline->buffer, line, sizeof hdrline->buffer);
 	TAILQ_INSERT_TAIL(&rp->header.lines, hdrline, next);
@@ -137,10 +162,14 @@ parser_feed_body(struct rfc2822_parser *rp, const char *line)
 void
 rfc2822_parser_init(struct rfc2822_parser *rp)
 {
+	size_t	i;
+
 	memset(rp, 0, sizeof *rp);
-	TAILQ_INIT(&rp->hdr_cb);
+	for (i = 0; i < RFC2822_HDR_CB_BUCKETS; i++)
+		TAILQ_INIT(&rp->hdr_cb[i]);
 	TAILQ_INIT(&rp->hdr_miss_cb);
 	TAILQ_INIT(&rp->header.lines);
+	TAILQ_INIT(&rp->lines_free);
 	rfc2822_header_default_callback(rp, hdr_dflt_cb, NULL);
 	rfc2822_body_callback(rp, body_dflt_cb, NULL);
 	rfc2822_parser_reset(rp);
@@ -160,7 +189,7 @@ rfc2822_parser_flush(struct rfc2822_parser *rp)
 void
 rfc2822_parser_reset(struct rfc2822_parser *rp)
 {
-	header_reset(&rp->header);
+	header_reset(rp);
 	rp->in_hdrs = 1;
 }
 
@@ -169,12 +198,19 @@ rfc2822_parser_release(struct rfc2822_parser *rp)
 {
 	struct rfc2822_hdr_cb		*cb;
 	struct rfc2822_hdr_miss_cb	*mcb;
+	struct rfc2822_line		*line;
+	size_t				 i;
 
 	rfc2822_parser_reset(rp);
-	while ((cb = TAILQ_FIRST(&rp->hdr_cb))) {
-		TAILQ_REMOVE(&rp->hdr_cb, cb, next);
-		free(cb);
+	while ((line = TAILQ_FIRST(&rp->lines_free))) {
+		TAILQ_REMOVE(&rp->lines_free, line, next);
+		free(line);
 	}
+	for (i = 0; i < RFC2822_HDR_CB_BUCKETS; i++)
+		while ((cb = TAILQ_FIRST(&rp->hdr_cb[i]))) {
+			TAILQ_REMOVE(&rp->hdr_cb[i], cb, next);
+			free(cb);
+		}
 	while ((mcb = TAILQ_FIRST(&rp->hdr_miss_cb))) {
 		TAILQ_REMOVE(&rp->hdr_miss_cb, mcb, next);
 		free(mcb);
@@ -214,15 +250,19 @@ rfc2822_header_callback(struct rfc2822_parser *rp, const char *header,
 {
 	struct rfc2822_hdr_cb  *cb;
 	struct rfc2822_hdr_cb  *cb_tmp;
+	struct hdr_cb	       *bucket;
+	uint32_t		hash;
 	char			buffer[RFC2822_MAX_LINE_SIZE+1];
 
 	/* line exceeds RFC maximum size requirement */
 	if (strlcpy(buffer, header, sizeof buffer) >= sizeof buffer)
 		return 0;
 
-	TAILQ_FOREACH_SAFE(cb, &rp->hdr_cb, next, cb_tmp) {
-		if (strcasecmp(cb->name, buffer) == 0) {
-			TAILQ_REMOVE(&rp->hdr_cb, cb, next);
+	hash = header_hash(buffer);
+	bucket = &rp->hdr_cb[hash & (RFC2822_HDR_CB_BUCKETS - 1)];
+	TAILQ_FOREACH_SAFE(cb, bucket, next, cb_tmp) {
+		if (cb->hash == hash && strcasecmp(cb->name, buffer) == 0) {
+			TAILQ_REMOVE(bucket, cb, next);
 			free(cb);
 		}
 	}
@@ -230,9 +270,10 @@ rfc2822_header_callback(struct rfc2822_parser *rp, const char *header,
 	if ((cb = calloc(1, sizeof *cb)) == NULL)
 		return -1;
 	(void)strlcpy(cb->name, buffer, sizeof cb->name);
+	cb->hash = hash;
 	cb->func = func;
 	cb->arg  = arg;
-	TAILQ_INSERT_TAIL(&rp->hdr_cb, cb, next);
+	TAILQ_INSERT_TAIL(bucket, cb, next);
 	return 1;
 }
 
@@ -258,6 +299,7 @@ rfc2822_missing_header_callback(struct rfc2822_parser *rp, const char *header,
 	if ((cb = calloc(1, sizeof *cb)) == NULL)
 		return -1;
 	(void)strlcpy(cb->name, buffer, sizeof cb->name);
+	cb->hash = header_hash(buffer);
 	cb->func = func;
 	cb->arg  = arg;
 	TAILQ_INSERT_TAIL(&rp->hdr_miss_cb, cb, next);
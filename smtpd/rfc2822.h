@@ -20,20 +20,24 @@
 #define	_RFC2822_H_
 
 #define	RFC2822_MAX_LINE_SIZE		4096
+#define	RFC2822_HDR_CB_BUCKETS		16	/* power of 2 */
 
 struct rfc2822_line {
 	TAILQ_ENTRY(rfc2822_line)	next;
 	char				buffer[RFC2822_MAX_LINE_SIZE+1];
 };
 
+TAILQ_HEAD(rfc2822_lines, rfc2822_line);
+
 struct rfc2822_header {
 	char				name[RFC2822_MAX_LINE_SIZE+1];
-	TAILQ_HEAD(, rfc2822_line)	lines;
+	struct rfc2822_lines		lines;
 };
 
 struct rfc2822_hdr_cb {
 	TAILQ_ENTRY(rfc2822_hdr_cb)	next;
 
+	uint32_t			hash;
 	char				name[RFC2822_MAX_LINE_SIZE+1];
 	void			      (*func)(const struct rfc2822_header *, void *);
 	void			       *arg;
@@ -42,6 +46,7 @@ struct rfc2822_hdr_cb {
 struct rfc2822_hdr_miss_cb {
 	TAILQ_ENTRY(rfc2822_hdr_miss_cb)	next;
 
+	uint32_t				hash;
 	char					name[RFC2822_MAX_LINE_SIZE+1];
 	void				      (*func)(const char *, void *);
 	void				       *arg;
@@ -55,11 +60,12 @@ struct rfc2822_line_cb {
 struct rfc2822_parser {
 	uint8_t					in_hdrs;	/* in headers */
 
-	TAILQ_HEAD(hdr_cb, rfc2822_hdr_cb)		hdr_cb;
+	TAILQ_HEAD(hdr_cb, rfc2822_hdr_cb)		hdr_cb[RFC2822_HDR_CB_BUCKETS];
 	TAILQ_HEAD(hdr_miss_cb, rfc2822_hdr_miss_cb)	hdr_miss_cb;
 
 	uint8_t					in_hdr;		/* in specific header */
 	struct rfc2822_header			header;
+	struct rfc2822_lines			lines_free;	/* recycled lines */
 
 	struct rfc2822_hdr_cb		        hdr_dflt_cb;
 	struct rfc2822_line_cb		        body_line_cb;
@@ -25,6 +25,8 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 
+#include <netinet/in.h>
+
 #include <err.h>
 #include <errno.h>
 #include <event.h>
@@ -37,6 +39,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <openssl/ssl.h>
@@ -57,12 +60,55 @@ static int smtp_sni_callback(SSL *, int *, void *);
 #define	SMTP_FD_RESERVE	5
 #define	getdtablecount()	0
 
+#define	SMTP_NETBLOCK4		24
+#define	SMTP_NETBLOCK6		48
+#define	SMTP_RATE_WINDOW	60
+#define	SMTP_REFUSED		"421 Too many connections, try again later\r\n"
+
+/* concurrency and connection rate of a client address or netblock */
+struct smtp_source {
+	SPLAY_ENTRY(smtp_source)	 entry;
+	int				 family;
+	int				 prefix;
+	uint8_t				 addr[16];
+	size_t				 sessions;
+	time_t				 window;
+	size_t				 connections;
+};
+
+SPLAY_HEAD(smtp_source_tree, smtp_source);
+static int smtp_source_cmp(struct smtp_source *, struct smtp_source *);
+SPLAY_PROTOTYPE(smtp_source_tree, smtp_source, entry, smtp_source_cmp);
+
+static int smtp_source_limited(void);
+static struct smtp_source *smtp_source_get(const struct sockaddr_storage *,
+    int, int);
+static void smtp_source_put(struct smtp_source *, time_t);
+static void smtp_source_timeout(int, short, void *);
+static int smtp_admit(const struct sockaddr_storage *);
+static void smtp_release(const struct sockaddr_storage *);
+
 static size_t	sessions;
 static size_t	maxsessions;
 
+static struct smtp_source_tree	sources;
+static struct event		sources_ev;
+
 void
 smtp_imsg(struct mproc *p, struct imsg *imsg)
 {
+	if (p->proc == PROC_PARENT) {
+		switch (imsg->hdr.type) {
+		case IMSG_SMTP_TLS_TICKET_KEY:
+			CHECK_IMSG_DATA_SIZE(imsg,
+			    sizeof(struct ssl_ticket_key));
+			ssl_ticket_key_set(imsg->data);
+			explicit_bzero(imsg->data,
+			    sizeof(struct ssl_ticket_key));
+			return;
+		}
+	}
+
 	if (p->proc == PROC_LKA) {
 		switch (imsg->hdr.type) {
 		case IMSG_SMTP_DNS_PTR:
@@ -160,6 +206,19 @@ smtp_setup_listeners(void)
 			sizeof(opt)) < 0)
 			fatal("smtpd: setsockopt");
 #endif
+		/*
+		 * With several pony workers, each one binds its own socket
+		 * and the kernel spreads incoming connections among them.
+		 */
+		if (env->sc_pony_workers > 1) {
+#ifdef SO_REUSEPORT
+			if (setsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+				sizeof(opt)) < 0)
+				fatal("smtpd: setsockopt");
+#else
+			fatalx("smtpd: workers require SO_REUSEPORT");
+#endif
+		}
 #ifdef IPV6_V6ONLY
 		/*
 		 * If using IPv6, bind only to IPv6 if possible.
@@ -211,6 +270,9 @@ smtp_setup_events(void)
 
 	maxsessions = (getdtablesize() - getdtablecount()) / 2 - SMTP_FD_RESERVE;
 	log_debug("debug: smtp: will accept at most %zu clients", maxsessions);
+
+	SPLAY_INIT(&sources);
+	evtimer_set(&sources_ev, smtp_source_timeout, NULL);
 }
 
 static void
@@ -273,44 +335,62 @@ smtp_accept(int fd, short event, void *p)
 	struct listener		*listener = p;
 	struct sockaddr_storage	 ss;
 	socklen_t		 len;
+	size_t			 n;
 	int			 sock;
 
 	if (env->sc_flags & SMTPD_SMTP_PAUSED)
 		fatalx("smtp_session: unexpected client");
 
-	if (!smtp_can_accept()) {
-		log_warnx("warn: Disabling incoming SMTP connections: "
-		    "Client limit reached");
-		goto pause;
-	}
-
-	len = sizeof(ss);
-	if ((sock = accept(fd, (struct sockaddr *)&ss, &len)) == -1) {
-		if (errno == ENFILE || errno == EMFILE) {
-			log_warn("warn: Disabling incoming SMTP connections");
+	/*
+	 * Drain up to sc_session_accept_batch pending connections per
+	 * wakeup, so that a burst does not cost one trip through the
+	 * event loop per client.
+	 */
+	for (n = 0; n < env->sc_session_accept_batch; n++) {
+		if (!smtp_can_accept()) {
+			log_warnx("warn: Disabling incoming SMTP connections: "
+			    "Client limit reached");
 			goto pause;
 		}
-		if (errno == EINTR || errno == EWOULDBLOCK ||
-		    errno == ECONNABORTED)
-			return;
-		fatal("smtp_accept");
-	}
 
-	if (smtp_session(listener, sock, &ss, NULL) == -1) {
-		log_warn("warn: Failed to create SMTP session");
-		close(sock);
-		return;
-	}
-	io_set_nonblocking(sock);
+		len = sizeof(ss);
+		if ((sock = accept(fd, (struct sockaddr *)&ss, &len)) == -1) {
+			if (errno == ENFILE || errno == EMFILE) {
+				log_warn("warn: Disabling incoming SMTP "
+				    "connections");
+				goto pause;
+			}
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return;
+			fatal("smtp_accept");
+		}
 
-	sessions++;
-	stat_increment("smtp.session", 1);
-	if (listener->ss.ss_family == AF_LOCAL)
-		stat_increment("smtp.session.local", 1);
-	if (listener->ss.ss_family == AF_INET)
-		stat_increment("smtp.session.inet4", 1);
-	if (listener->ss.ss_family == AF_INET6)
-		stat_increment("smtp.session.inet6", 1);
+		if (!smtp_admit(&ss)) {
+			io_set_nonblocking(sock);
+			(void)write(sock, SMTP_REFUSED, sizeof(SMTP_REFUSED) - 1);
+			close(sock);
+			continue;
+		}
+
+		if (smtp_session(listener, sock, &ss, NULL) == -1) {
+			log_warn("warn: Failed to create SMTP session");
+			smtp_release(&ss);
+			close(sock);
+			return;
+		}
+		io_set_nonblocking(sock);
+
+		sessions++;
+		stat_increment("smtp.session", 1);
+		if (listener->ss.ss_family == AF_LOCAL)
+			stat_increment("smtp.session.local", 1);
+		if (listener->ss.ss_family == AF_INET)
+			stat_increment("smtp.session.inet4", 1);
+		if (listener->ss.ss_family == AF_INET6)
+			stat_increment("smtp.session.inet6", 1);
+	}
 	return;
 
 pause:
@@ -327,11 +407,185 @@ smtp_can_accept(void)
 	return (getdtablesize() - getdtablecount() - SMTP_FD_RESERVE >= 2);
 }
 
+/*
+ * Enforce the per-source and per-netblock limits on a new client, and
+ * account for its session if it is let in.
+ */
+static int
+smtp_admit(const struct sockaddr_storage *ss)
+{
+	struct smtp_source	*host, *net;
+	time_t			 now;
+
+	if (!smtp_source_limited())
+		return (1);
+	if ((host = smtp_source_get(ss, 0, 1)) == NULL)
+		return (1);
+	net = smtp_source_get(ss, 1, 1);
+
+	now = time(NULL);
+	if (host->window + SMTP_RATE_WINDOW <= now) {
+		host->window = now;
+		host->connections = 0;
+	}
+	if (net->window + SMTP_RATE_WINDOW <= now) {
+		net->window = now;
+		net->connections = 0;
+	}
+
+	if ((env->sc_session_max_per_source &&
+	    host->sessions >= env->sc_session_max_per_source) ||
+	    (env->sc_session_rate_per_source &&
+	    host->connections >= env->sc_session_rate_per_source)) {
+		log_debug("debug: smtp: refusing client %s: source limit",
+		    ss_to_text(ss));
+		stat_increment("smtp.refused.source", 1);
+		goto refuse;
+	}
+	if ((env->sc_session_max_per_netblock &&
+	    net->sessions >= env->sc_session_max_per_netblock) ||
+	    (env->sc_session_rate_per_netblock &&
+	    net->connections >= env->sc_session_rate_per_netblock)) {
+		log_debug("debug: smtp: refusing client %s: netblock limit",
+		    ss_to_text(ss));
+		stat_increment("smtp.refused.netblock", 1);
+		goto refuse;
+	}
+
+	host->sessions++;
+	host->connections++;
+	net->sessions++;
+	net->connections++;
+	return (1);
+
+refuse:
+	smtp_source_put(host, now);
+	smtp_source_put(net, now);
+	return (0);
+}
+
+static int
+smtp_source_limited(void)
+{
+	return (env->sc_session_max_per_source ||
+	    env->sc_session_max_per_netblock ||
+	    env->sc_session_rate_per_source ||
+	    env->sc_session_rate_per_netblock);
+}
+
+/*
+ * Look up the entry for a client address, or for its netblock.  Only
+ * inet4 and inet6 clients are tracked.
+ */
+static struct smtp_source *
+smtp_source_get(const struct sockaddr_storage *ss, int netblock, int create)
+{
+	struct smtp_source	 key, *src;
+	struct timeval		 tv;
+	size_t			 len;
+
+	memset(&key, 0, sizeof key);
+	key.family = ss->ss_family;
+	if (ss->ss_family == AF_INET) {
+		len = sizeof(struct in_addr);
+		memmove(key.addr,
+		    &((const struct sockaddr_in *)ss)->sin_addr, len);
+		key.prefix = netblock ? SMTP_NETBLOCK4 : 32;
+	}
+	else if (ss->ss_family == AF_INET6) {
+		len = sizeof(struct in6_addr);
+		memmove(key.addr,
+		    &((const struct sockaddr_in6 *)ss)->sin6_addr, len);
+		key.prefix = netblock ? SMTP_NETBLOCK6 : 128;
+	}
+	else
+		return (NULL);
+	memset(key.addr + key.prefix / 8, 0, len - key.prefix / 8);
+
+	if ((src = SPLAY_FIND(smtp_source_tree, &sources, &key)) || !create)
+		return (src);
+
+	src = xmemdup(&key, sizeof key, "smtp_source_get");
+	SPLAY_INSERT(smtp_source_tree, &sources, src);
+
+	/* forget about idle sources once their rate window is over */
+	if (!evtimer_pending(&sources_ev, NULL)) {
+		tv.tv_sec = SMTP_RATE_WINDOW;
+		tv.tv_usec = 0;
+		evtimer_add(&sources_ev, &tv);
+	}
+	return (src);
+}
+
+static void
+smtp_release(const struct sockaddr_storage *ss)
+{
+	struct smtp_source	*src;
+	time_t			 now;
+
+	if (!smtp_source_limited())
+		return;
+
+	now = time(NULL);
+	if ((src = smtp_source_get(ss, 0, 0)) != NULL) {
+		src->sessions--;
+		smtp_source_put(src, now);
+	}
+	if ((src = smtp_source_get(ss, 1, 0)) != NULL) {
+		src->sessions--;
+		smtp_source_put(src, now);
+	}
+}
+
+static void
+smtp_source_put(struct smtp_source *src, time_t now)
+{
+	if (src->sessions)
+		return;
+	if ((env->sc_session_rate_per_source ||
+	    env->sc_session_rate_per_netblock) &&
+	    src->window + SMTP_RATE_WINDOW > now)
+		return;
+
+	SPLAY_REMOVE(smtp_source_tree, &sources, src);
+	free(src);
+}
+
+static void
+smtp_source_timeout(int fd, short event, void *p)
+{
+	struct smtp_source	*src, *next;
+	struct timeval		 tv = { SMTP_RATE_WINDOW, 0 };
+	time_t			 now;
+
+	now = time(NULL);
+	for (src = SPLAY_MIN(smtp_source_tree, &sources); src; src = next) {
+		next = SPLAY_NEXT(smtp_source_tree, &sources, src);
+		smtp_source_put(src, now);
+	}
+
+	if (!SPLAY_EMPTY(&sources))
+		evtimer_add(&sources_ev, &tv);
+}
+
+static int
+smtp_source_cmp(struct smtp_source *a, struct smtp_source *b)
+{
+	if (a->family != b->family)
+		return (a->family < b->family ? -1 : 1);
+	if (a->prefix != b->prefix)
+		return (a->prefix < b->prefix ? -1 : 1);
+	return (memcmp(a->addr, b->addr, sizeof a->addr));
+}
+
+SPLAY_GENERATE(smtp_source_tree, smtp_source, entry, smtp_source_cmp);
+
 void
-smtp_collect(void)
+smtp_collect(const struct sockaddr_storage *ss)
 {
 	sessions--;
 	stat_decrement("smtp.session", 1);
+	smtp_release(ss);
 
 	if (!smtp_can_accept())
 		return;
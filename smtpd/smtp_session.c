@@ -26,6 +26,7 @@
 #include <sys/tree.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/resource.h>
 
 #include <netinet/in.h>
 
@@ -74,6 +75,8 @@ enum session_flags {
 	SF_FILTERCONN		= 0x0100,
 	SF_FILTERDATA		= 0x0200,
 	SF_FILTERTX		= 0x0400,
+	SF_PIPELINED		= 0x0800,
+	SF_BUSY			= 0x1000,	/* waiting to reply */
 };
 
 enum message_flags {
@@ -94,6 +97,7 @@ enum smtp_command {
 	CMD_MAIL_FROM,
 	CMD_RCPT_TO,
 	CMD_DATA,
+	CMD_BDAT,
 	CMD_RSET,
 	CMD_QUIT,
 	CMD_HELP,
@@ -101,6 +105,17 @@ enum smtp_command {
 	CMD_NOOP,
 };
 
+struct header_address {
+	char		buffer[APPEND_DOMAIN_BUFFER_SIZE];
+	size_t		len;
+	int		skip;
+	int		escape, quote, comment, bracket;
+	int		has_domain, has_bracket, has_group;
+	size_t		pos_bracket_beg, pos_bracket_end;
+	size_t		pos_component_beg, pos_component_end;
+	size_t		pos_stop;
+};
+
 struct smtp_rcpt {
 	TAILQ_ENTRY(smtp_rcpt)	 entry;
  	struct mailaddr		 maddr;
@@ -129,6 +144,13 @@ struct smtp_tx {
 
 	int			 skiphdr;
 	struct rfc2822_parser	 rfc2822_parser;
+
+	int			 chunking;	/* body sent with BDAT */
+	int			 chunklast;
+	size_t			 chunksize;
+	size_t			 chunklen;	/* left in current chunk */
+	size_t			 chunklinelen;
+	char			 chunkline[LINE_MAX];
 };
 
 struct smtp_session {
@@ -150,6 +172,8 @@ struct smtp_session {
 
 	size_t			 mailcount;
 	struct event		 pause;
+	struct event		 pipeline;
+	size_t			 chunkskip;	/* rejected BDAT data */
 
 	struct smtp_tx		*tx;
 };
@@ -166,11 +190,17 @@ struct smtp_session {
 
 static int smtp_mailaddr(struct mailaddr *, char *, int, char **, const char *);
 static void smtp_session_init(void);
+static void smtp_memory_update(int, short, void *);
 static int smtp_lookup_servername(struct smtp_session *);
 static void smtp_connected(struct smtp_session *);
 static void smtp_send_banner(struct smtp_session *);
 static void smtp_tls_verified(struct smtp_session *);
 static void smtp_io(struct io *, int, void *);
+static void smtp_io_datain(struct smtp_session *);
+static void smtp_pipeline(int, short, void *);
+static void smtp_pipeline_schedule(struct smtp_session *);
+static void smtp_bdat_data(struct smtp_session *);
+static void smtp_bdat_line(struct smtp_session *);
 static void smtp_data_io(struct io *, int, void *);
 static void smtp_data_io_done(struct smtp_session *);
 static void smtp_enter_state(struct smtp_session *, int);
@@ -218,6 +248,7 @@ static struct { int code; const char *cmd; } commands[] = {
 	{ CMD_MAIL_FROM,	"MAIL FROM" },
 	{ CMD_RCPT_TO,		"RCPT TO" },
 	{ CMD_DATA,		"DATA" },
+	{ CMD_BDAT,		"BDAT" },
 	{ CMD_RSET,		"RSET" },
 	{ CMD_QUIT,		"QUIT" },
 	{ CMD_HELP,		"HELP" },
@@ -239,6 +270,33 @@ static struct tree wait_queue_commit;
 static struct tree wait_ssl_init;
 static struct tree wait_ssl_verify;
 
+/*
+ * Freed sessions and transactions are kept for reuse, so that a busy
+ * server does not go through the allocator for every connection.
+ */
+#define	SMTP_POOL_MAX		64
+#define	SMTP_MEMORY_INTERVAL	5
+
+static struct smtp_session	*session_pool[SMTP_POOL_MAX];
+static size_t			 session_pooled;
+static struct smtp_tx		*tx_pool[SMTP_POOL_MAX];
+static size_t			 tx_pooled;
+
+/* bytes currently used per subsystem, and last values reported */
+static struct {
+	const char	*key;
+	size_t		 used;
+	size_t		 reported;
+} smtp_memory[] = {
+#define	MEM_SESSION	0
+	{ "memory.smtp.session",	0, 0 },
+#define	MEM_TX		1
+	{ "memory.smtp.tx",		0, 0 },
+#define	MEM_POOL	2
+	{ "memory.smtp.pool",		0, 0 },
+};
+static struct event	smtp_memory_ev;
+
 static void
 header_default_callback(const struct rfc2822_header *hdr, void *arg)
 {
@@ -266,334 +324,243 @@ header_bcc_callback(const struct rfc2822_header *hdr, void *arg)
 {
 }
 
+/*
+ * Addresses in To/Cc/From headers are tokenized in a single pass: each
+ * character is fed once into the current address, which records as it
+ * goes where a domain may be appended and which span a masquerade would
+ * replace.  The address is then written out in one go from its buffer,
+ * so the cost is linear in the size of the header.
+ */
 static void
-header_append_domain_buffer(char *buffer, char *domain, size_t len)
+header_address_reset(struct header_address *a)
 {
-	size_t	i;
-	int	escape, quote, comment, bracket;
-	int	has_domain, has_bracket, has_group;
-	int	pos_bracket, pos_component, pos_insert;
-	char	copy[APPEND_DOMAIN_BUFFER_SIZE];
-
-	i = 0;
-	escape = quote = comment = bracket = 0;
-	has_domain = has_bracket = has_group = 0;
-	pos_bracket = pos_insert = pos_component = 0;
-	for (i = 0; buffer[i]; ++i) {
-		if (buffer[i] == '(' && !escape && !quote)
-			comment++;
-		if (buffer[i] == '"' && !escape && !comment)
-			quote = !quote;
-		if (buffer[i] == ')' && !escape && !quote && comment)
-			comment--;
-		if (buffer[i] == '\\' && !escape && !comment && !quote)
-			escape = 1;
-		else
-			escape = 0;
-		if (buffer[i] == '<' && !escape && !comment && !quote && !bracket) {
-			bracket++;
-			has_bracket = 1;
-		}
-		if (buffer[i] == '>' && !escape && !comment && !quote && bracket) {
-			bracket--;
-			pos_bracket = i;
-		}
-		if (buffer[i] == '@' && !escape && !comment && !quote)
-			has_domain = 1;
-		if (buffer[i] == ':' && !escape && !comment && !quote)
-			has_group = 1;
+	a->len = 0;
+	a->buffer[0] = '\0';
+	a->skip = 0;
+	a->escape = a->quote = a->comment = a->bracket = 0;
+	a->has_domain = a->has_bracket = a->has_group = 0;
+	a->pos_bracket_beg = a->pos_bracket_end = 0;
+	a->pos_component_beg = a->pos_component_end = 0;
+	a->pos_stop = 0;
+}
 
-		/* update insert point if not in comment and not on a whitespace */
-		if (!comment && buffer[i] != ')' && !isspace((unsigned char)buffer[i]))
-			pos_component = i;
+static int
+header_address_feed(struct header_address *a, char c)
+{
+	size_t	i = a->len;
+
+	if (c == '(' && !a->escape && !a->quote)
+		a->comment++;
+	if (c == '"' && !a->escape && !a->comment)
+		a->quote = !a->quote;
+	if (c == ')' && !a->escape && !a->quote && a->comment)
+		a->comment--;
+	if (c == '\\' && !a->escape && !a->comment && !a->quote)
+		a->escape = 1;
+	else
+		a->escape = 0;
+	if (c == '<' && !a->escape && !a->comment && !a->quote && !a->bracket) {
+		a->bracket++;
+		a->has_bracket = 1;
+		a->pos_bracket_beg = i + 1;
+	}
+	if (c == '>' && !a->escape && !a->comment && !a->quote && a->bracket) {
+		a->bracket--;
+		a->pos_bracket_end = i;
+	}
+	if (c == '@' && !a->escape && !a->comment && !a->quote)
+		a->has_domain = 1;
+	if (c == ':' && !a->escape && !a->comment && !a->quote)
+		a->has_group = 1;
+
+	/* a component starts right after the last closing paren or space */
+	if (c == ')' || isspace((unsigned char)c))
+		a->pos_stop = i + 1;
+
+	/* update insert point if not in comment and not on a whitespace */
+	if (!a->comment && c != ')' && !isspace((unsigned char)c)) {
+		a->pos_component_end = i;
+		a->pos_component_beg = a->pos_stop;
 	}
 
-	/* parse error, do not attempt to modify */
-	if (escape || quote || comment || bracket)
-		return;
+	a->buffer[a->len++] = c;
+	a->buffer[a->len] = '\0';
 
-	/* domain already present, no need to modify */
-	if (has_domain)
-		return;
+	return (a->len < sizeof(a->buffer) - 1);
+}
 
-	/* address is group, skip */
-	if (has_group)
-		return;
+/*
+ * Find where the local domain should be inserted in an address that
+ * lacks one.  Returns 0 if the address must be left untouched.
+ */
+static int
+header_address_domain_pos(struct header_address *a, size_t *pos)
+{
+	size_t	i;
+
+	/* domain already present, no need to modify */
+	if (a->has_domain)
+		return 0;
 
 	/* there's an address between brackets, just append domain */
-	if (has_bracket) {
-		pos_bracket--;
-		while (isspace((unsigned char)buffer[pos_bracket]))
-			pos_bracket--;
-		if (buffer[pos_bracket] == '<')
-			return;
-		pos_insert = pos_bracket + 1;
+	if (a->has_bracket) {
+		i = a->pos_bracket_end - 1;
+		while (isspace((unsigned char)a->buffer[i]))
+			i--;
+		if (a->buffer[i] == '<')
+			return 0;
+		*pos = i + 1;
+		return 1;
 	}
-	else {
-		/* otherwise append address to last component */
-		pos_insert = pos_component + 1;
 
-		/* empty address */
-                if (buffer[pos_component] == '\0' ||
-		    isspace((unsigned char)buffer[pos_component]))
-                        return;
+	/* empty address */
+	if (a->buffer[a->pos_component_end] == '\0' ||
+	    isspace((unsigned char)a->buffer[a->pos_component_end]))
+		return 0;
+
+	/* otherwise append address to last component */
+	*pos = a->pos_component_end + 1;
+	return 1;
+}
+
+static int
+header_address_write(struct smtp_session *s, struct header_address *a,
+    const char *domain, const char *masquerade, const char *sep)
+{
+	size_t	pos, beg, end;
+	int	append;
+
+	if (a->skip || a->len + strlen(domain) + 1 >= sizeof(a->buffer))
+		return smtp_message_printf(s, "%s%s", a->buffer, sep);
+
+	/* parse error or group, do not attempt to modify */
+	if (a->escape || a->quote || a->comment || a->bracket || a->has_group)
+		return smtp_message_printf(s, "%s%s", a->buffer, sep);
+
+	append = header_address_domain_pos(a, &pos);
+
+	if (masquerade) {
+		/* replace everything between brackets, or the last component */
+		if (a->has_bracket) {
+			beg = a->pos_bracket_beg;
+			end = a->pos_bracket_end;
+		}
+		else if (a->pos_component_end == 0 && !append)
+			beg = end = 0;
+		else if (a->pos_component_end == 0 && a->buffer[0] == ')')
+			beg = end = 1;
+		else if (a->pos_component_end == 0 && a->buffer[0] == '(') {
+			/* the appended domain ends up inside the comment */
+			if (a->len + strlen(domain) + 1 + strlen(masquerade) <
+			    sizeof(a->buffer))
+				return smtp_message_printf(s, "%s(@%s%s%s",
+				    masquerade, domain, a->buffer + 1, sep);
+			goto noreplace;
+		}
+		else {
+			beg = a->pos_component_beg;
+			end = a->pos_component_end + 1;
+		}
+
+		/* check that masquerade won't overflow */
+		if (a->len - (end - beg) + strlen(masquerade) < sizeof(a->buffer))
+			return smtp_message_printf(s, "%.*s%s%s%s",
+			    (int)beg, a->buffer, masquerade, a->buffer + end, sep);
 	}
 
-	if (snprintf(copy, sizeof copy, "%.*s@%s%s",
-		(int)pos_insert, buffer,
-		domain,
-		buffer+pos_insert) >= (int)sizeof copy)
-		return;
+noreplace:
+	if (!append)
+		return smtp_message_printf(s, "%s%s", a->buffer, sep);
 
-	memcpy(buffer, copy, len);
+	return smtp_message_printf(s, "%.*s@%s%s%s",
+	    (int)pos, a->buffer, domain, a->buffer + pos, sep);
 }
 
 static void
-header_domain_append_callback(const struct rfc2822_header *hdr, void *arg)
+header_address_rewrite(struct smtp_session *s, const struct rfc2822_header *hdr,
+    const char *masquerade)
 {
-	struct smtp_session    *s = arg;
+	struct header_address	a;
 	struct rfc2822_line    *l;
-	size_t			i, j;
-	int			escape, quote, comment, skip;
-	char			buffer[APPEND_DOMAIN_BUFFER_SIZE];
+	const char	       *domain = s->listener->hostname;
+	size_t			i, len;
+	int			escape, quote, comment;
+	char			c;
 
 	if (smtp_message_printf(s, "%s:", hdr->name) == -1)
 		return;
 
-	i = j = 0;
-	escape = quote = comment = skip = 0;
-	memset(buffer, 0, sizeof buffer);
+	escape = quote = comment = 0;
+	header_address_reset(&a);
 
 	TAILQ_FOREACH(l, &hdr->lines, next) {
-		for (i = 0; i < strlen(l->buffer); ++i) {
-			if (l->buffer[i] == '(' && !escape && !quote)
+		len = strlen(l->buffer);
+		for (i = 0; i < len; ++i) {
+			c = l->buffer[i];
+			if (c == '(' && !escape && !quote)
 				comment++;
-			if (l->buffer[i] == '"' && !escape && !comment)
+			if (c == '"' && !escape && !comment)
 				quote = !quote;
-			if (l->buffer[i] == ')' && !escape && !quote && comment)
+			if (c == ')' && !escape && !quote && comment)
 				comment--;
-			if (l->buffer[i] == '\\' && !escape && !comment && !quote)
+			if (c == '\\' && !escape && !comment && !quote)
 				escape = 1;
 			else
 				escape = 0;
 
 			/* found a separator, buffer contains a full address */
-			if (l->buffer[i] == ',' && !escape && !quote && !comment) {
-				if (!skip && j + strlen(s->listener->hostname) + 1 < sizeof buffer)
-					header_append_domain_buffer(buffer, s->listener->hostname, sizeof buffer);
-				if (smtp_message_printf(s, "%s,", buffer) == -1)
+			if (c == ',' && !escape && !quote && !comment) {
+				if (header_address_write(s, &a, domain,
+				    masquerade, ",") == -1)
 					return;
-				j = 0;
-				skip = 0;
-				memset(buffer, 0, sizeof buffer);
+				header_address_reset(&a);
+				continue;
 			}
-			else {
-				if (skip) {
-					if (smtp_message_printf(s, "%c",
-					    l->buffer[i]) == -1)
-						return;
-				}
-				else {
-					buffer[j++] = l->buffer[i];
-					if (j == sizeof (buffer) - 1) {
-						if (smtp_message_printf(s, "%s",
-						    buffer) != -1)
-							return;
-						skip = 1;
-						j = 0;
-						memset(buffer, 0, sizeof buffer);
-					}
-				}
+
+			/* address too long, pass it through unmodified */
+			if (a.skip) {
+				if (smtp_message_printf(s, "%c", c) == -1)
+					return;
+				continue;
+			}
+			if (!header_address_feed(&a, c)) {
+				if (smtp_message_printf(s, "%s", a.buffer) == -1)
+					return;
+				header_address_reset(&a);
+				a.skip = 1;
 			}
 		}
-		if (skip) {
+		if (a.skip) {
 			if (smtp_message_printf(s, "\n") == -1)
 				return;
 		}
-		else {
-			buffer[j++] = '\n';
-			if (j == sizeof (buffer) - 1) {
-				if (smtp_message_printf(s, "%s", buffer) == -1)
-					return;
-				skip = 1;
-				j = 0;
-				memset(buffer, 0, sizeof buffer);
-			}
+		else if (!header_address_feed(&a, '\n')) {
+			if (smtp_message_printf(s, "%s", a.buffer) == -1)
+				return;
+			header_address_reset(&a);
+			a.skip = 1;
 		}
 	}
 
 	/* end of header, if buffer is not empty we'll process it */
-	if (buffer[0]) {
-		if (j + strlen(s->listener->hostname) + 1 < sizeof buffer)
-			header_append_domain_buffer(buffer, s->listener->hostname, sizeof buffer);
-		smtp_message_printf(s, "%s", buffer);
-	}
+	if (a.len)
+		header_address_write(s, &a, domain, masquerade, "");
 }
 
 static void
-header_address_rewrite_buffer(char *buffer, const char *address, size_t len)
+header_domain_append_callback(const struct rfc2822_header *hdr, void *arg)
 {
-	size_t	i;
-	int	address_len;
-	int	escape, quote, comment, bracket;
-	int	has_bracket, has_group;
-	int	pos_bracket_beg, pos_bracket_end, pos_component_beg, pos_component_end;
-	int	insert_beg, insert_end;
-	char	copy[APPEND_DOMAIN_BUFFER_SIZE];
-
-	escape = quote = comment = bracket = 0;
-	has_bracket = has_group = 0;
-	pos_bracket_beg = pos_bracket_end = pos_component_beg = pos_component_end = 0;
-	for (i = 0; buffer[i]; ++i) {
-		if (buffer[i] == '(' && !escape && !quote)
-			comment++;
-		if (buffer[i] == '"' && !escape && !comment)
-			quote = !quote;
-		if (buffer[i] == ')' && !escape && !quote && comment)
-			comment--;
-		if (buffer[i] == '\\' && !escape && !comment && !quote)
-			escape = 1;
-		else
-			escape = 0;
-		if (buffer[i] == '<' && !escape && !comment && !quote && !bracket) {
-			bracket++;
-			has_bracket = 1;
-			pos_bracket_beg = i+1;
-		}
-		if (buffer[i] == '>' && !escape && !comment && !quote && bracket) {
-			bracket--;
-			pos_bracket_end = i;
-		}
-		if (buffer[i] == ':' && !escape && !comment && !quote)
-			has_group = 1;
-
-		/* update insert point if not in comment and not on a whitespace */
-		if (!comment && buffer[i] != ')' && !isspace((unsigned char)buffer[i]))
-			pos_component_end = i;
-	}
-
-	/* parse error, do not attempt to modify */
-	if (escape || quote || comment || bracket)
-		return;
-
-	/* address is group, skip */
-	if (has_group)
-		return;
-
-	/* there's an address between brackets, just replace everything brackets */
-	if (has_bracket) {
-		insert_beg = pos_bracket_beg;
-		insert_end = pos_bracket_end;
-	}
-	else {
-		if (pos_component_end == 0)
-			pos_component_beg = 0;
-		else {
-			for (pos_component_beg = pos_component_end; pos_component_beg >= 0; --pos_component_beg)
-				if (buffer[pos_component_beg] == ')' || isspace(buffer[pos_component_beg]))
-					break;
-			pos_component_beg += 1;
-			pos_component_end += 1;
-		}
-		insert_beg = pos_component_beg;
-		insert_end = pos_component_end;
-	}
-
-	/* check that masquerade won' t overflow */
-	address_len = strlen(address);
-	if (strlen(buffer) - (insert_end - insert_beg) + address_len >= len)
-		return;
+	struct smtp_session    *s = arg;
 
-	(void)strlcpy(copy, buffer, sizeof copy);
-	(void)strlcpy(copy+insert_beg, address, sizeof (copy) - insert_beg);
-	(void)strlcat(copy, buffer+insert_end, sizeof (copy));
-	memcpy(buffer, copy, len);
+	header_address_rewrite(s, hdr, NULL);
 }
 
 static void
 header_masquerade_callback(const struct rfc2822_header *hdr, void *arg)
 {
 	struct smtp_session    *s = arg;
-	struct rfc2822_line    *l;
-	size_t			i, j;
-	int			escape, quote, comment, skip;
-	char			buffer[APPEND_DOMAIN_BUFFER_SIZE];
-
-	if (smtp_message_printf(s, "%s:", hdr->name) == -1)
-		return;
-
-	j = 0;
-	escape = quote = comment = skip = 0;
-	memset(buffer, 0, sizeof buffer);
-
-	TAILQ_FOREACH(l, &hdr->lines, next) {
-		for (i = 0; i < strlen(l->buffer); ++i) {
-			if (l->buffer[i] == '(' && !escape && !quote)
-				comment++;
-			if (l->buffer[i] == '"' && !escape && !comment)
-				quote = !quote;
-			if (l->buffer[i] == ')' && !escape && !quote && comment)
-				comment--;
-			if (l->buffer[i] == '\\' && !escape && !comment && !quote)
-				escape = 1;
-			else
-				escape = 0;
-
-			/* found a separator, buffer contains a full address */
-			if (l->buffer[i] == ',' && !escape && !quote && !comment) {
-				if (!skip && j + strlen(s->listener->hostname) + 1 < sizeof buffer) {
-					header_append_domain_buffer(buffer, s->listener->hostname, sizeof buffer);
-					header_address_rewrite_buffer(buffer, mailaddr_to_text(&s->tx->evp.sender),
-					    sizeof buffer);
-				}
-				if (smtp_message_printf(s, "%s,", buffer) == -1)
-					return;
-				j = 0;
-				skip = 0;
-				memset(buffer, 0, sizeof buffer);
-			}
-			else {
-				if (skip) {
-					if (smtp_message_printf(s, "%c", l->buffer[i]) == -1)
-						return;
-				}
-				else {
-					buffer[j++] = l->buffer[i];
-					if (j == sizeof (buffer) - 1) {
-						if (smtp_message_printf(s, "%s", buffer) == -1)
-							return;
-						skip = 1;
-						j = 0;
-						memset(buffer, 0, sizeof buffer);
-					}
-				}
-			}
-		}
-		if (skip) {
-			if (smtp_message_printf(s, "\n") == -1)
-				return;
-		}
-		else {
-			buffer[j++] = '\n';
-			if (j == sizeof (buffer) - 1) {
-				if (smtp_message_printf(s, "%s", buffer) == -1)
-					return;
-				skip = 1;
-				j = 0;
-				memset(buffer, 0, sizeof buffer);
-			}
-		}
-	}
 
-	/* end of header, if buffer is not empty we'll process it */
-	if (buffer[0]) {
-		if (j + strlen(s->listener->hostname) + 1 < sizeof buffer) {
-			header_append_domain_buffer(buffer, s->listener->hostname, sizeof buffer);
-			header_address_rewrite_buffer(buffer, mailaddr_to_text(&s->tx->evp.sender),
-			    sizeof buffer);
-		}
-		smtp_message_printf(s, "%s", buffer);
-	}
+	header_address_rewrite(s, hdr, mailaddr_to_text(&s->tx->evp.sender));
 }
 
 static void
@@ -627,10 +594,52 @@ smtp_session_init(void)
 		tree_init(&wait_queue_commit);
 		tree_init(&wait_ssl_init);
 		tree_init(&wait_ssl_verify);
+
+		evtimer_set(&smtp_memory_ev, smtp_memory_update, NULL);
+		smtp_memory_update(-1, 0, NULL);
 		init = 1;
 	}
 }
 
+/*
+ * Report memory usage to the stat backend.  Deltas are used so that the
+ * figures of several pony workers add up.
+ */
+static void
+smtp_memory_update(int fd, short event, void *p)
+{
+	struct stat_value	 val;
+	struct rusage		 ru;
+	struct timeval		 tv;
+	char			 key[STAT_KEY_SIZE];
+	size_t			 i;
+
+	for (i = 0; i < nitems(smtp_memory); i++) {
+		if (smtp_memory[i].used > smtp_memory[i].reported)
+			stat_increment(smtp_memory[i].key,
+			    smtp_memory[i].used - smtp_memory[i].reported);
+		else
+			stat_decrement(smtp_memory[i].key,
+			    smtp_memory[i].reported - smtp_memory[i].used);
+		smtp_memory[i].reported = smtp_memory[i].used;
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		if (env->sc_pony_workers > 1)
+			(void)snprintf(key, sizeof key,
+			    "memory.pony.%d.maxrss", pony_worker);
+		else
+			(void)strlcpy(key, "memory.pony.maxrss", sizeof key);
+		val.type = STAT_COUNTER;
+		val.u.counter = (size_t)ru.ru_maxrss * 1024;
+		stat_set(key, &val);
+	}
+
+	tv.tv_sec = SMTP_MEMORY_INTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&smtp_memory_ev, &tv);
+}
+
 int
 smtp_session(struct listener *listener, int sock,
     const struct sockaddr_storage *ss, const char *hostname)
@@ -641,17 +650,24 @@ smtp_session(struct listener *listener, int sock,
 
 	smtp_session_init();
 
-	if ((s = calloc(1, sizeof(*s))) == NULL)
+	if (session_pooled) {
+		s = session_pool[--session_pooled];
+		memset(s, 0, sizeof(*s));
+		smtp_memory[MEM_POOL].used -= sizeof(*s);
+	}
+	else if ((s = calloc(1, sizeof(*s))) == NULL)
 		return (-1);
 
 	if (iobuf_init(&s->iobuf, LINE_MAX, LINE_MAX) == -1) {
 		free(s);
 		return (-1);
 	}
+	smtp_memory[MEM_SESSION].used += sizeof(*s) + LINE_MAX;
 
 	s->id = generate_uid();
 	s->listener = listener;
 	memmove(&s->ss, ss, sizeof(*ss));
+	evtimer_set(&s->pipeline, smtp_pipeline, s);
 	io_init(&s->io, &s->iobuf);
 	io_set_callback(&s->io, smtp_io, s);
 	io_set_fd(&s->io, sock);
@@ -859,6 +875,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		}
 		else {
 			rcpt = xcalloc(1, sizeof(*rcpt), "smtp_rcpt");
+			smtp_memory[MEM_TX].used += sizeof(*rcpt);
 			rcpt->destcount = s->tx->destcount;
 			rcpt->maddr = s->tx->evp.rcpt;
 			TAILQ_INSERT_TAIL(&s->tx->rcpts, rcpt, entry);
@@ -1091,6 +1108,8 @@ smtp_filter_response(uint64_t id, int query, int status, uint32_t code,
 			smtp_reply(s, "250-8BITMIME");
 			smtp_reply(s, "250-ENHANCEDSTATUSCODES");
 			smtp_reply(s, "250-SIZE %zu", env->sc_maxsize);
+			smtp_reply(s, "250-PIPELINING");
+			smtp_reply(s, "250-CHUNKING");
 			if (ADVERTISE_EXT_DSN(s))
 				smtp_reply(s, "250-DSN");
 			if (ADVERTISE_TLS(s))
@@ -1142,6 +1161,13 @@ smtp_filter_response(uint64_t id, int query, int status, uint32_t code,
 
 	case QUERY_DATA:
 		if (status != FILTER_OK) {
+			/* drop the chunk and the transaction it started */
+			if (s->tx->chunking) {
+				s->chunkskip = s->tx->chunklen;
+				smtp_filter_tx_rollback(s);
+				smtp_queue_rollback(s);
+				smtp_tx_free(s->tx);
+			}
 			code = code ? code : 530;
 			line = line ? line : "Message rejected";
 			smtp_reply(s, "%d %s", code, line);
@@ -1237,11 +1263,16 @@ smtp_filter_fd(uint64_t id, int fd)
 
 	io_set_write(&s->tx->oev);
 
+	tree_xset(&wait_filter_data, s->id, s);
+
 	smtp_enter_state(s, STATE_BODY);
-	smtp_reply(s, "354 Enter mail, end with \".\""
-	    " on a line by itself");
 
-	tree_xset(&wait_filter_data, s->id, s);
+	/* BDAT data follows the command, there is no go-ahead */
+	if (s->tx->chunking)
+		smtp_pipeline_schedule(s);
+	else
+		smtp_reply(s, "354 Enter mail, end with \".\""
+		    " on a line by itself");
 }
 
 static void
@@ -1249,8 +1280,6 @@ smtp_io(struct io *io, int evt, void *arg)
 {
 	struct ca_cert_req_msg	req_ca_cert;
 	struct smtp_session    *s = arg;
-	char		       *line;
-	size_t			len;
 
 	log_trace(TRACE_IO, "smtp: %p: %s %s", s, io_strevent(evt),
 	    io_strio(io));
@@ -1264,6 +1293,12 @@ smtp_io(struct io *io, int evt, void *arg)
 		s->flags |= SF_SECURE;
 		s->helo[0] = '\0';
 
+		stat_increment("smtp.tls.handshake", 1);
+		if (SSL_session_reused(io_ssl(&s->io)))
+			stat_increment("smtp.tls.resumed", 1);
+		if (ssl_ktls_active(io_ssl(&s->io)))
+			stat_increment("smtp.tls.ktls", 1);
+
 		if (smtp_verify_certificate(s)) {
 			io_pause(&s->io, IO_PAUSE_IN);
 			break;
@@ -1281,57 +1316,7 @@ smtp_io(struct io *io, int evt, void *arg)
 		break;
 
 	case IO_DATAIN:
-	    nextline:
-		line = io_getline(&s->io, &len);
-		if ((line == NULL && io_datalen(&s->io) >= LINE_MAX) ||
-		    (line && len >= LINE_MAX)) {
-			s->flags |= SF_BADINPUT;
-			smtp_reply(s, "500 %s: Line too long",
-			    esc_code(ESC_STATUS_PERMFAIL, ESC_OTHER_STATUS));
-			smtp_enter_state(s, STATE_QUIT);
-			io_set_write(io);
-			return;
-		}
-
-		/* No complete line received */
-		if (line == NULL)
-			return;
-
-		/* Message body */
-		if (s->state == STATE_BODY && strcmp(line, ".")) {
-			smtp_filter_dataline(s, line);
-			goto nextline;
-		}
-
-		/* Pipelining not supported */
-		if (io_datalen(&s->io)) {
-			s->flags |= SF_BADINPUT;
-			smtp_reply(s, "500 %s %s: Pipelining not supported",
-			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
-			    esc_description(ESC_INVALID_COMMAND));
-			smtp_enter_state(s, STATE_QUIT);
-			io_set_write(io);
-			return;
-		}
-
-		/* End of body */
-		if (s->state == STATE_BODY) {
-			log_trace(TRACE_SMTP, "<<< [EOM]");
-
-			rfc2822_parser_flush(&s->tx->rfc2822_parser);
-
-			io_set_write(io);
-
-			s->tx->dataeom = 1;
-			if (io_queued(&s->tx->oev) == 0)
-				smtp_data_io_done(s);
-			return;
-		}
-
-		/* Must be a command */
-		(void)strlcpy(s->cmd, line, sizeof s->cmd);
-		io_set_write(io);
-		smtp_command(s, line);
+		smtp_io_datain(s);
 		break;
 
 	case IO_LOWAT:
@@ -1343,6 +1328,10 @@ smtp_io(struct io *io, int evt, void *arg)
 			break;
 		}
 
+		/* held back replies went out, the command is still running */
+		if (s->flags & SF_BUSY)
+			break;
+
 		/* Wait for the client to start tls */
 		if (s->state == STATE_TLS) {
 			req_ca_cert.reqid = s->id;
@@ -1364,6 +1353,10 @@ smtp_io(struct io *io, int evt, void *arg)
 		}
 
 		io_set_read(io);
+
+		/* the last read also brought in pipelined input */
+		if (io_datalen(io))
+			smtp_io_datain(s);
 		break;
 
 	case IO_TIMEOUT:
@@ -1392,14 +1385,210 @@ smtp_io(struct io *io, int evt, void *arg)
 	}
 }
 
+static void
+smtp_io_datain(struct smtp_session *s)
+{
+	struct io	*io = &s->io;
+	char		*line;
+	size_t		 len;
+
+	/* any deferred dispatch is handled from here on */
+	s->flags &= ~SF_PIPELINED;
+
+    nextline:
+	/* data of a rejected BDAT chunk */
+	if (s->chunkskip) {
+		len = MIN(s->chunkskip, io_datalen(io));
+		io_drop(io, len);
+		s->chunkskip -= len;
+		if (s->chunkskip)
+			goto flush;
+	}
+
+	/* BDAT chunk, raw octets rather than lines */
+	if (s->state == STATE_BODY && s->tx->chunking) {
+		smtp_bdat_data(s);
+		return;
+	}
+
+	line = io_getline(io, &len);
+	if ((line == NULL && io_datalen(io) >= LINE_MAX) ||
+	    (line && len >= LINE_MAX)) {
+		s->flags |= SF_BADINPUT;
+		smtp_reply(s, "500 %s: Line too long",
+		    esc_code(ESC_STATUS_PERMFAIL, ESC_OTHER_STATUS));
+		smtp_enter_state(s, STATE_QUIT);
+		io_set_write(io);
+		return;
+	}
+
+	/* No complete line received */
+	if (line == NULL)
+		goto flush;
+
+	/* Message body */
+	if (s->state == STATE_BODY && strcmp(line, ".")) {
+		/* escape lines starting with a '.' */
+		smtp_filter_dataline(s, (line[0] == '.') ? line + 1 : line);
+		goto nextline;
+	}
+
+	/* End of body */
+	if (s->state == STATE_BODY) {
+		log_trace(TRACE_SMTP, "<<< [EOM]");
+
+		rfc2822_parser_flush(&s->tx->rfc2822_parser);
+
+		s->flags |= SF_BUSY;
+		io_set_write(io);
+
+		s->tx->dataeom = 1;
+		if (io_queued(&s->tx->oev) == 0)
+			smtp_data_io_done(s);
+		return;
+	}
+
+	/*
+	 * Must be a command.  Commands are handled one at a time: the
+	 * next pipelined one is picked up once this one has been fully
+	 * replied to, see smtp_reply().
+	 */
+	(void)strlcpy(s->cmd, line, sizeof s->cmd);
+	s->flags |= SF_BUSY;
+	io_set_write(io);
+	smtp_command(s, line);
+	return;
+
+    flush:
+	/* waiting for the client, send replies held back so far */
+	if (io_queued(io))
+		io_set_write(io);
+}
+
+/*
+ * Replies to pipelined commands are not flushed one by one.  Once a
+ * command is complete and more input is already buffered, the session
+ * goes back to reading from the buffer, and the replies queued so far
+ * are written together when it runs dry or a command has to wait.
+ */
+static void
+smtp_pipeline(int fd, short event, void *p)
+{
+	struct smtp_session	*s = p;
+
+	if (!(s->flags & SF_PIPELINED))
+		return;
+
+	/* these states are driven by the output being flushed */
+	if (s->state == STATE_TLS || s->state == STATE_QUIT) {
+		s->flags &= ~SF_PIPELINED;
+		return;
+	}
+
+	s->flags &= ~SF_BUSY;
+	io_set_read(&s->io);
+	smtp_io_datain(s);
+}
+
+static void
+smtp_pipeline_schedule(struct smtp_session *s)
+{
+	struct timeval	tv;
+
+	s->flags |= SF_PIPELINED;
+	timerclear(&tv);
+	evtimer_add(&s->pipeline, &tv);
+}
+
+static void
+smtp_bdat_data(struct smtp_session *s)
+{
+	struct smtp_tx	*tx = s->tx;
+	char		*data, *nl;
+	size_t		 len, n, i;
+
+	len = MIN(tx->chunklen, io_datalen(&s->io));
+	data = io_data(&s->io);
+
+	for (i = 0; i < len; i += n) {
+		nl = memchr(data + i, '\n', len - i);
+		n = nl ? (size_t)(nl - (data + i)) : len - i;
+		if (tx->chunklinelen + n >= sizeof(tx->chunkline)) {
+			s->flags |= SF_BADINPUT;
+			smtp_reply(s, "500 %s: Line too long",
+			    esc_code(ESC_STATUS_PERMFAIL, ESC_OTHER_STATUS));
+			smtp_enter_state(s, STATE_QUIT);
+			io_set_write(&s->io);
+			return;
+		}
+		memcpy(tx->chunkline + tx->chunklinelen, data + i, n);
+		tx->chunklinelen += n;
+		if (nl) {
+			smtp_bdat_line(s);
+			n++;
+		}
+	}
+	io_drop(&s->io, len);
+	tx->chunklen -= len;
+
+	/* rest of the chunk still on its way */
+	if (tx->chunklen) {
+		if (io_queued(&s->io))
+			io_set_write(&s->io);
+		return;
+	}
+
+	s->flags |= SF_BUSY;
+	io_set_write(&s->io);
+
+	if (!tx->chunklast) {
+		smtp_enter_state(s, STATE_HELO);
+		smtp_reply(s, "250 %s: %zu octets received",
+		    esc_code(ESC_STATUS_OK, ESC_OTHER_STATUS), tx->chunksize);
+		return;
+	}
+
+	/* unterminated last line */
+	if (tx->chunklinelen)
+		smtp_bdat_line(s);
+
+	log_trace(TRACE_SMTP, "<<< [EOM]");
+
+	rfc2822_parser_flush(&tx->rfc2822_parser);
+
+	tx->dataeom = 1;
+	if (io_queued(&tx->oev) == 0)
+		smtp_data_io_done(s);
+}
+
+static void
+smtp_bdat_line(struct smtp_session *s)
+{
+	struct smtp_tx	*tx = s->tx;
+	size_t		 len = tx->chunklinelen;
+
+	if (len && tx->chunkline[len - 1] == '\r')
+		len--;
+	tx->chunkline[len] = '\0';
+	tx->chunklinelen = 0;
+
+	/* no dot-stuffing with BDAT */
+	smtp_filter_dataline(s, tx->chunkline);
+}
+
 static int
 smtp_tx(struct smtp_session *s)
 {
 	struct smtp_tx *tx;
 
-	tx = calloc(1, sizeof(*tx));
-	if (tx == NULL)
+	if (tx_pooled) {
+		tx = tx_pool[--tx_pooled];
+		memset(tx, 0, sizeof(*tx));
+		smtp_memory[MEM_POOL].used -= sizeof(*tx);
+	}
+	else if ((tx = calloc(1, sizeof(*tx))) == NULL)
 		return 0;
+	smtp_memory[MEM_TX].used += sizeof(*tx);
 
 	TAILQ_INIT(&tx->rcpts);
 	io_init(&tx->oev, NULL);
@@ -1454,11 +1643,18 @@ smtp_tx_free(struct smtp_tx *tx)
 	while ((rcpt = TAILQ_FIRST(&tx->rcpts))) {
 		TAILQ_REMOVE(&tx->rcpts, rcpt, entry);
 		free(rcpt);
+		smtp_memory[MEM_TX].used -= sizeof(*rcpt);
 	}
 
 	tx->session->tx = NULL;
 
-	free(tx);
+	smtp_memory[MEM_TX].used -= sizeof(*tx);
+	if (tx_pooled < SMTP_POOL_MAX) {
+		tx_pool[tx_pooled++] = tx;
+		smtp_memory[MEM_POOL].used += sizeof(*tx);
+	}
+	else
+		free(tx);
 }
 
 static void
@@ -1538,7 +1734,9 @@ smtp_data_io_done(struct smtp_session *s)
 static void
 smtp_command(struct smtp_session *s, char *line)
 {
-	char			       *args, *eom, *method;
+	char			       *args, *eom, *method, *chunk;
+	const char		       *errstr;
+	size_t				size;
 	int				cmd, i;
 
 	log_trace(TRACE_SMTP, "smtp: %p: <<< %s", s, line);
@@ -1607,7 +1805,8 @@ smtp_command(struct smtp_session *s, char *line)
 			break;
 		}
 		(void)strlcpy(s->helo, args, sizeof(s->helo));
-		s->flags &= SF_SECURE | SF_AUTHENTICATED | SF_VERIFIED | SF_FILTERCONN;
+		s->flags &= SF_SECURE | SF_AUTHENTICATED | SF_VERIFIED | SF_FILTERCONN |
+		    SF_BUSY;
 		if (cmd == CMD_EHLO) {
 			s->flags |= SF_EHLO;
 			s->flags |= SF_8BITMIME;
@@ -1645,6 +1844,15 @@ smtp_command(struct smtp_session *s, char *line)
 			    esc_description(ESC_INVALID_COMMAND_ARGUMENTS));
 			break;
 		}
+		/* nothing may be sent in clear after STARTTLS */
+		if (io_datalen(&s->io)) {
+			s->flags |= SF_BADINPUT;
+			smtp_reply(s, "500 %s %s: Pipelining not allowed after STARTTLS",
+			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+			    esc_description(ESC_INVALID_COMMAND));
+			smtp_enter_state(s, STATE_QUIT);
+			break;
+		}
 		smtp_reply(s, "220 %s: Ready to start TLS",
 		    esc_code(ESC_STATUS_OK, ESC_OTHER_STATUS));
 		smtp_enter_state(s, STATE_TLS);
@@ -1757,7 +1965,8 @@ smtp_command(struct smtp_session *s, char *line)
 	 * TRANSACTION
 	 */
 	case CMD_RCPT_TO:
-		if (s->tx == NULL) {
+		/* no more recipients once BDAT has opened the message */
+		if (s->tx == NULL || s->tx->chunking) {
 			smtp_reply(s, "503 %s %s: Command not allowed at this point.",
 			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 			    esc_description(ESC_INVALID_COMMAND));
@@ -1793,6 +2002,11 @@ smtp_command(struct smtp_session *s, char *line)
 		}
 
 		if (s->tx) {
+			/* between two BDAT chunks the message is still open */
+			if (tree_pop(&wait_filter_data, s->id)) {
+				io_clear(&s->tx->oev);
+				iobuf_clear(&s->tx->obuf);
+			}
 			smtp_filter_tx_rollback(s);
 			if (s->tx->msgid)
 				smtp_queue_rollback(s);
@@ -1805,7 +2019,7 @@ smtp_command(struct smtp_session *s, char *line)
 		break;
 
 	case CMD_DATA:
-		if (s->tx == NULL) {
+		if (s->tx == NULL || s->tx->chunking) {
 			smtp_reply(s, "503 %s %s: Command not allowed at this point.",
 			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
 			    esc_description(ESC_INVALID_COMMAND));
@@ -1820,6 +2034,45 @@ smtp_command(struct smtp_session *s, char *line)
 
 		smtp_filter_data(s);
 		break;
+
+	case CMD_BDAT:
+		/* without a valid size the chunk boundary is lost */
+		size = 0;
+		errstr = "missing";
+		if (args && (chunk = strsep(&args, " ")) != NULL)
+			size = strtonum(chunk, 0, SSIZE_MAX, &errstr);
+		if (errstr || (args && *args && strcasecmp(args, "LAST"))) {
+			s->flags |= SF_BADINPUT;
+			smtp_reply(s, "501 %s %s: Syntax error",
+			    esc_code(ESC_STATUS_PERMFAIL, ESC_SYNTAX_ERROR),
+			    esc_description(ESC_SYNTAX_ERROR));
+			smtp_enter_state(s, STATE_QUIT);
+			break;
+		}
+
+		if (s->tx == NULL || s->tx->rcptcount == 0) {
+			s->chunkskip = size;
+			smtp_reply(s, "503 %s %s: %s",
+			    esc_code(ESC_STATUS_PERMFAIL, ESC_INVALID_COMMAND),
+			    esc_description(ESC_INVALID_COMMAND),
+			    s->tx ? "No recipient specified" :
+			    "Command not allowed at this point.");
+			break;
+		}
+
+		s->tx->chunksize = s->tx->chunklen = size;
+		s->tx->chunklast = (args && *args);
+
+		/* first chunk opens the message */
+		if (!s->tx->chunking) {
+			s->tx->chunking = 1;
+			smtp_filter_data(s);
+			break;
+		}
+
+		smtp_enter_state(s, STATE_BODY);
+		smtp_pipeline_schedule(s);
+		break;
 	/*
 	 * ANY
 	 */
@@ -2196,6 +2449,13 @@ smtp_reply(struct smtp_session *s, char *fmt, ...)
 
 	io_xprintf(&s->io, "%s\r\n", buf);
 
+	/* command complete, move on to the next pipelined one */
+	if (buf[3] != '-') {
+		s->flags &= ~SF_BUSY;
+		if (io_datalen(&s->io))
+			smtp_pipeline_schedule(s);
+	}
+
 	switch (buf[0]) {
 	case '5':
 	case '4':
@@ -2238,6 +2498,7 @@ smtp_free(struct smtp_session *s, const char * reason)
 {
 	log_debug("debug: smtp: %p: deleting session: %s", s, reason);
 
+	evtimer_del(&s->pipeline);
 	tree_pop(&wait_filter_data, s->id);
 
 	if (s->tx) {
@@ -2260,9 +2521,16 @@ smtp_free(struct smtp_session *s, const char * reason)
 
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
-	free(s);
 
-	smtp_collect();
+	smtp_collect(&s->ss);
+
+	smtp_memory[MEM_SESSION].used -= sizeof(*s) + LINE_MAX;
+	if (session_pooled < SMTP_POOL_MAX) {
+		session_pool[session_pooled++] = s;
+		smtp_memory[MEM_POOL].used += sizeof(*s);
+	}
+	else
+		free(s);
 }
 
 static int
@@ -2589,10 +2857,6 @@ smtp_filter_dataline(struct smtp_session *s, const char *line)
 	if (s->tx->msgflags & MF_ERROR)
 		return;
 
-	/* escape lines starting with a '.' */
-	if (line[0] == '.')
-		line += 1;
-
 	/* account for newline */
 	s->tx->datain += strlen(line) + 1;
 	if (s->tx->datain > env->sc_maxsize) {
@@ -710,6 +710,32 @@ do_show_hoststats(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_show_memory(int argc, struct parameter *argv)
+{
+	struct stat_kv	kv;
+
+	memset(&kv, 0, sizeof kv);
+
+	while (1) {
+		srv_send(IMSG_CTL_GET_STATS, &kv, sizeof kv);
+		srv_recv(IMSG_CTL_GET_STATS);
+		srv_read(&kv, sizeof(kv));
+		srv_end();
+
+		if (kv.iter == NULL)
+			break;
+
+		if (strncmp(kv.key, "memory.", 7) != 0 ||
+		    kv.val.type != STAT_COUNTER)
+			continue;
+
+		printf("%s=%zu\n", kv.key + 7, kv.val.u.counter);
+	}
+
+	return (0);
+}
+
 static int
 do_show_message(int argc, struct parameter *argv)
 {
@@ -1081,6 +1107,7 @@ main(int argc, char **argv)
 	cmd_install("schedule all",		do_schedule);
 	cmd_install("show envelope <evpid>",	do_show_envelope);
 	cmd_install("show hoststats",		do_show_hoststats);
+	cmd_install("show memory",		do_show_memory);
 	cmd_install("show message <msgid>",	do_show_message);
 	cmd_install("show message <evpid>",	do_show_message);
 	cmd_install("show queue",		do_show_queue);
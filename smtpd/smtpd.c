@@ -45,6 +45,7 @@
 #ifdef HAVE_CRYPT_H
 #include <crypt.h> /* needed for crypt() */
 #endif
+#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
@@ -96,6 +97,7 @@ static void parent_send_config(int, short, void *);
 static void parent_send_config_lka(void);
 static void parent_send_config_pony(void);
 static void parent_send_config_ca(void);
+static void parent_send_ticket_key(int, short, void *);
 static void parent_sig_handler(int, short, void *);
 static void forkmda(struct mproc *, uint64_t, struct deliver *);
 static int parent_forward_open(char *, char *, uid_t, gid_t);
@@ -146,6 +148,7 @@ TAILQ_HEAD(, offline)		offline_q;
 
 static struct event		config_ev;
 static struct event		offline_ev;
+static struct event		ticket_ev;
 static struct timeval		offline_timeout;
 
 static pid_t			purge_pid = -1;
@@ -163,7 +166,11 @@ struct mproc	*p_parent = NULL;
 struct mproc	*p_queue = NULL;
 struct mproc	*p_scheduler = NULL;
 struct mproc	*p_pony = NULL;
+struct mproc	*p_ponies[PONY_WORKERS_MAX];
 struct mproc	*p_ca = NULL;
+struct mproc	*p_cas[PONY_WORKERS_MAX];
+
+int	pony_worker = 0;
 
 const char	*backend_queue = "fs";
 const char	*backend_scheduler = "ramqueue";
@@ -312,10 +319,13 @@ usage(void)
 static void
 parent_shutdown(void)
 {
-	pid_t pid;
+	pid_t	pid;
+	int	i;
 
-	mproc_clear(p_ca);
-	mproc_clear(p_pony);
+	for (i = 0; i < env->sc_pony_workers; i++) {
+		mproc_clear(p_cas[i]);
+		mproc_clear(p_ponies[i]);
+	}
 	mproc_clear(p_control);
 	mproc_clear(p_lka);
 	mproc_clear(p_scheduler);
@@ -340,12 +350,35 @@ parent_send_config(int fd, short event, void *p)
 	purge_config(PURGE_PKI);
 }
 
+static void
+parent_send_ticket_key(int fd, short event, void *p)
+{
+	struct ssl_ticket_key	key;
+	struct timeval		tv;
+	int			i;
+
+	arc4random_buf(&key, sizeof(key));
+	for (i = 0; i < env->sc_pony_workers; i++)
+		m_compose(p_ponies[i], IMSG_SMTP_TLS_TICKET_KEY, 0, 0, -1,
+		    &key, sizeof(key));
+	explicit_bzero(&key, sizeof(key));
+
+	tv.tv_sec = SSL_TICKET_KEY_ROTATE;
+	tv.tv_usec = 0;
+	evtimer_add(&ticket_ev, &tv);
+}
+
 static void
 parent_send_config_pony(void)
 {
-	log_debug("debug: parent_send_config: configuring pony process");
-	m_compose(p_pony, IMSG_CONF_START, 0, 0, -1, NULL, 0);
-	m_compose(p_pony, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	int	i;
+
+	for (i = 0; i < env->sc_pony_workers; i++) {
+		log_debug("debug: parent_send_config: "
+		    "configuring pony process #%d", i);
+		m_compose(p_ponies[i], IMSG_CONF_START, 0, 0, -1, NULL, 0);
+		m_compose(p_ponies[i], IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	}
 }
 
 void
@@ -359,15 +392,20 @@ parent_send_config_lka()
 static void
 parent_send_config_ca(void)
 {
+	int	i;
+
 	log_debug("debug: parent_send_config: configuring ca process");
-	m_compose(p_ca, IMSG_CONF_START, 0, 0, -1, NULL, 0);
-	m_compose(p_ca, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	for (i = 0; i < env->sc_pony_workers; i++) {
+		m_compose(p_cas[i], IMSG_CONF_START, 0, 0, -1, NULL, 0);
+		m_compose(p_cas[i], IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	}
 }
 
 static void
 parent_sig_handler(int sig, short event, void *p)
 {
 	struct child	*child;
+	struct mproc	*proc;
 	int		 status, fail;
 	pid_t		 pid;
 	char		*cause;
@@ -441,11 +479,12 @@ parent_sig_handler(int sig, short event, void *p)
 				log_debug("debug: smtpd: mda process done "
 				    "for session %016"PRIx64 ": %s",
 				    child->mda_id, cause);
-				m_create(p_pony, IMSG_MDA_DONE, 0, 0,
+				proc = pony_by_id(child->mda_id);
+				m_create(proc, IMSG_MDA_DONE, 0, 0,
 				    child->mda_out);
-				m_add_id(p_pony, child->mda_id);
-				m_add_string(p_pony, cause);
-				m_close(p_pony);
+				m_add_id(proc, child->mda_id);
+				m_add_string(proc, cause);
+				m_close(proc);
 				/* free(cause); */
 				break;
 
@@ -712,8 +751,12 @@ main(int argc, char *argv[])
 
 		/* setup all processes */
 
-		p_ca = start_child(save_argc, save_argv, "ca");
-		p_ca->proc = PROC_CA;
+		/* one ca process per pony worker */
+		for (i = 0; i < env->sc_pony_workers; i++) {
+			p_cas[i] = start_child(save_argc, save_argv, "ca");
+			p_cas[i]->proc = PROC_CA;
+		}
+		p_ca = p_cas[0];
 
 		p_control = start_child(save_argc, save_argv, "control");
 		p_control->proc = PROC_CONTROL;
@@ -721,8 +764,11 @@ main(int argc, char *argv[])
 		p_lka = start_child(save_argc, save_argv, "lka");
 		p_lka->proc = PROC_LKA;
 
-		p_pony = start_child(save_argc, save_argv, "pony");
-		p_pony->proc = PROC_PONY;
+		for (i = 0; i < env->sc_pony_workers; i++) {
+			p_ponies[i] = start_child(save_argc, save_argv, "pony");
+			p_ponies[i]->proc = PROC_PONY;
+		}
+		p_pony = p_ponies[0];
 
 		p_queue = start_child(save_argc, save_argv, "queue");
 		p_queue->proc = PROC_QUEUE;
@@ -730,17 +776,29 @@ main(int argc, char *argv[])
 		p_scheduler = start_child(save_argc, save_argv, "scheduler");
 		p_scheduler->proc = PROC_SCHEDULER;
 
-		setup_peers(p_control, p_ca);
+		for (i = 0; i < env->sc_pony_workers; i++)
+			setup_peers(p_control, p_cas[i]);
 		setup_peers(p_control, p_lka);
-		setup_peers(p_control, p_pony);
+		for (i = 0; i < env->sc_pony_workers; i++)
+			setup_peers(p_control, p_ponies[i]);
 		setup_peers(p_control, p_queue);
 		setup_peers(p_control, p_scheduler);
-		setup_peers(p_pony, p_ca);
-		setup_peers(p_pony, p_lka);
-		setup_peers(p_pony, p_queue);
+		for (i = 0; i < env->sc_pony_workers; i++) {
+			setup_peers(p_ponies[i], p_cas[i]);
+			setup_peers(p_ponies[i], p_lka);
+			setup_peers(p_ponies[i], p_queue);
+		}
 		setup_peers(p_queue, p_lka);
 		setup_peers(p_queue, p_scheduler);
 
+		for (i = 0; i < env->sc_pony_workers; i++) {
+			if (imsg_compose(&p_ponies[i]->imsgbuf,
+			    IMSG_SETUP_WORKER, 0, 0, -1, &i, sizeof(i)) == -1)
+				fatal("imsg_compose");
+			if (imsg_flush(&p_ponies[i]->imsgbuf) == -1)
+				fatal("imsg_flush");
+		}
+
 		if (env->sc_queue_key) {
 			if (imsg_compose(&p_queue->imsgbuf, IMSG_SETUP_KEY, 0,
 			    0, -1, env->sc_queue_key, strlen(env->sc_queue_key)
@@ -750,10 +808,12 @@ main(int argc, char *argv[])
 				fatal("imsg_flush");
 		}
 
-		setup_done(p_ca);
+		for (i = 0; i < env->sc_pony_workers; i++)
+			setup_done(p_cas[i]);
 		setup_done(p_control);
 		setup_done(p_lka);
-		setup_done(p_pony);
+		for (i = 0; i < env->sc_pony_workers; i++)
+			setup_done(p_ponies[i]);
 		setup_done(p_queue);
 		setup_done(p_scheduler);
 
@@ -950,6 +1010,12 @@ setup_proc(void)
 		case IMSG_SETUP_KEY:
 			env->sc_queue_key = strdup(imsg.data);
 			break;
+		case IMSG_SETUP_WORKER:
+			if (imsg.hdr.len - IMSG_HEADER_SIZE !=
+			    sizeof(pony_worker))
+				fatalx("bad worker setup");
+			memcpy(&pony_worker, imsg.data, sizeof(pony_worker));
+			break;
 		case IMSG_SETUP_PEER:
 			setup_peer(imsg.hdr.peerid, imsg.hdr.pid, imsg.fd);
 			break;
@@ -975,6 +1041,7 @@ static struct mproc *
 setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 {
 	struct mproc *p, **pp;
+	int i;
 
 	log_debug("setup_peer: %s -> %s[%u] fd=%d", proc_title(smtpd_process),
 	    proc_title(proc), pid, sock);
@@ -996,10 +1063,21 @@ setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 		pp = &p_scheduler;
 		break;
 	case PROC_PONY:
-		pp = &p_pony;
+		/* workers are always set up in order */
+		for (i = 0; i < PONY_WORKERS_MAX; i++)
+			if (p_ponies[i] == NULL)
+				break;
+		if (i == PONY_WORKERS_MAX)
+			fatalx("too many pony workers");
+		pp = &p_ponies[i];
 		break;
 	case PROC_CA:
-		pp = &p_ca;
+		for (i = 0; i < PONY_WORKERS_MAX; i++)
+			if (p_cas[i] == NULL)
+				break;
+		if (i == PONY_WORKERS_MAX)
+			fatalx("too many ca processes");
+		pp = &p_cas[i];
 		break;
 	default:
 		fatalx("unknown peer");
@@ -1019,6 +1097,10 @@ setup_peer(enum smtp_proc_type proc, pid_t pid, int sock)
 	p->handler = imsg_dispatch;
 
 	*pp = p;
+	if (proc == PROC_PONY)
+		p_pony = p_ponies[0];
+	if (proc == PROC_CA)
+		p_ca = p_cas[0];
 
 	return p;
 }
@@ -1058,6 +1140,7 @@ smtpd(void) {
 	struct event	 ev_sigchld;
 	struct event	 ev_sighup;
 	struct timeval	 tv;
+	int		 i;
 
 	imsg_callback = parent_imsg;
 
@@ -1067,8 +1150,11 @@ smtpd(void) {
 	child_add(p_control->pid, CHILD_DAEMON, proc_title(PROC_CONTROL));
 	child_add(p_lka->pid, CHILD_DAEMON, proc_title(PROC_LKA));
 	child_add(p_scheduler->pid, CHILD_DAEMON, proc_title(PROC_SCHEDULER));
-	child_add(p_pony->pid, CHILD_DAEMON, proc_title(PROC_PONY));
-	child_add(p_ca->pid, CHILD_DAEMON, proc_title(PROC_CA));
+	for (i = 0; i < env->sc_pony_workers; i++)
+		child_add(p_ponies[i]->pid, CHILD_DAEMON,
+		    proc_title(PROC_PONY));
+	for (i = 0; i < env->sc_pony_workers; i++)
+		child_add(p_cas[i]->pid, CHILD_DAEMON, proc_title(PROC_CA));
 
 	event_init();
 
@@ -1092,6 +1178,10 @@ smtpd(void) {
 	memset(&tv, 0, sizeof(tv));
 	evtimer_add(&config_ev, &tv);
 
+	/* distribute and periodically rotate TLS session ticket keys */
+	evtimer_set(&ticket_ev, parent_send_ticket_key, NULL);
+	evtimer_add(&ticket_ev, &tv);
+
 	/* defer offline scanning for a second */
 	evtimer_set(&offline_ev, offline_scan, NULL);
 	offline_timeout.tv_sec = 1;
@@ -1290,29 +1380,29 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 	db = delivery_backend_lookup(deliver->mode);
 	if (db == NULL) {
 		(void)snprintf(ebuf, sizeof ebuf, "could not find delivery backend");
-		m_create(p_pony, IMSG_MDA_DONE, 0, 0, -1);
-		m_add_id(p_pony, id);
-		m_add_string(p_pony, ebuf);
-		m_close(p_pony);
+		m_create(p, IMSG_MDA_DONE, 0, 0, -1);
+		m_add_id(p, id);
+		m_add_string(p, ebuf);
+		m_close(p);
 		return;
 	}
 
 	if (deliver->userinfo.uid == 0 && !db->allow_root) {
 		(void)snprintf(ebuf, sizeof ebuf, "not allowed to deliver to: %s",
 		    deliver->user);
-		m_create(p_pony, IMSG_MDA_DONE, 0, 0, -1);
-		m_add_id(p_pony, id);
-		m_add_string(p_pony, ebuf);
-		m_close(p_pony);
+		m_create(p, IMSG_MDA_DONE, 0, 0, -1);
+		m_add_id(p, id);
+		m_add_string(p, ebuf);
+		m_close(p);
 		return;
 	}
 
 	if (pipe(pipefd) < 0) {
 		(void)snprintf(ebuf, sizeof ebuf, "pipe: %s", strerror(errno));
-		m_create(p_pony, IMSG_MDA_DONE, 0, 0, -1);
-		m_add_id(p_pony, id);
-		m_add_string(p_pony, ebuf);
-		m_close(p_pony);
+		m_create(p, IMSG_MDA_DONE, 0, 0, -1);
+		m_add_id(p, id);
+		m_add_string(p, ebuf);
+		m_close(p);
 		return;
 	}
 
@@ -1321,10 +1411,10 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 	allout = mkstemp(sfn);
 	if (allout < 0) {
 		(void)snprintf(ebuf, sizeof ebuf, "mkstemp: %s", strerror(errno));
-		m_create(p_pony, IMSG_MDA_DONE, 0, 0, -1);
-		m_add_id(p_pony, id);
-		m_add_string(p_pony, ebuf);
-		m_close(p_pony);
+		m_create(p, IMSG_MDA_DONE, 0, 0, -1);
+		m_add_id(p, id);
+		m_add_string(p, ebuf);
+		m_close(p);
 		close(pipefd[0]);
 		close(pipefd[1]);
 		return;
@@ -1334,10 +1424,10 @@ forkmda(struct mproc *p, uint64_t id, struct deliver *deliver)
 	pid = fork();
 	if (pid < 0) {
 		(void)snprintf(ebuf, sizeof ebuf, "fork: %s", strerror(errno));
-		m_create(p_pony, IMSG_MDA_DONE, 0, 0, -1);
-		m_add_id(p_pony, id);
-		m_add_string(p_pony, ebuf);
-		m_close(p_pony);
+		m_create(p, IMSG_MDA_DONE, 0, 0, -1);
+		m_add_id(p, id);
+		m_add_string(p, ebuf);
+		m_close(p);
 		close(pipefd[0]);
 		close(pipefd[1]);
 		close(allout);
@@ -1763,6 +1853,37 @@ proc_name(enum smtp_proc_type proc)
 	}
 }
 
+/*
+ * Return the pony worker which owns the session or request with the given
+ * id.  Ids generated in a pony process carry the worker number.
+ */
+struct mproc *
+pony_by_id(uint64_t id)
+{
+	if (env->sc_pony_workers <= 1)
+		return (p_pony);
+
+	return (p_ponies[PONY_WORKER(id) % env->sc_pony_workers]);
+}
+
+/*
+ * Return the pony worker responsible for the given key, so that all
+ * deliveries for a relay or a local user share the same MTA or MDA state.
+ */
+struct mproc *
+pony_by_key(const char *key)
+{
+	uint32_t	h;
+
+	if (env->sc_pony_workers <= 1)
+		return (p_pony);
+
+	for (h = 5381; *key; key++)
+		h = h * 33 + (unsigned char)tolower((unsigned char)*key);
+
+	return (p_ponies[h % env->sc_pony_workers]);
+}
+
 #define CASE(x) case x : return #x
 
 const char *
@@ -1813,6 +1934,7 @@ imsg_to_str(int type)
 	CASE(IMSG_CTL_SMTP_SESSION);
 
 	CASE(IMSG_SETUP_KEY);
+	CASE(IMSG_SETUP_WORKER);
 	CASE(IMSG_SETUP_PEER);
 	CASE(IMSG_SETUP_DONE);
 
@@ -1870,6 +1992,7 @@ imsg_to_str(int type)
 	CASE(IMSG_MTA_DNS_MX);
 	CASE(IMSG_MTA_DNS_MX_PREFERENCE);
 	CASE(IMSG_MTA_HOLDQ_RELEASE);
+	CASE(IMSG_MTA_HOSTSTATS);
 	CASE(IMSG_MTA_LOOKUP_CREDENTIALS);
 	CASE(IMSG_MTA_LOOKUP_SOURCE);
 	CASE(IMSG_MTA_LOOKUP_HELO);
@@ -1900,6 +2023,7 @@ imsg_to_str(int type)
 	CASE(IMSG_SMTP_TLS_VERIFY_CERT);
 	CASE(IMSG_SMTP_TLS_VERIFY_CHAIN);
 	CASE(IMSG_SMTP_TLS_VERIFY);
+	CASE(IMSG_SMTP_TLS_TICKET_KEY);
 
 	CASE(IMSG_SMTP_REQ_CONNECT);
 	CASE(IMSG_SMTP_REQ_HELO);
@@ -1914,6 +2038,7 @@ imsg_to_str(int type)
 
 	CASE(IMSG_CA_PRIVENC);
 	CASE(IMSG_CA_PRIVDEC);
+	CASE(IMSG_CA_ECDSA_SIGN);
 	default:
 		(void)snprintf(buf, sizeof(buf), "IMSG_??? (%d)", type);
 
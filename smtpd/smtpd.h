@@ -78,6 +78,10 @@
 #define SMTPD_SESSION_TIMEOUT	 300
 #define SMTPD_BACKLOG		 5
 
+#define PONY_WORKERS_MAX	 32
+#define PONY_WORKER_SHIFT	 56
+#define PONY_WORKER(id)		 ((int)((uint64_t)(id) >> PONY_WORKER_SHIFT))
+
 #ifndef PATH_SMTPCTL
 #define	PATH_SMTPCTL		"/usr/sbin/smtpctl"
 #endif
@@ -85,6 +89,8 @@
 #define PATH_OFFLINE		"/offline"
 #define PATH_PURGE		"/purge"
 #define PATH_TEMPORARY		"/temporary"
+#define PATH_STATS		"/stats"
+#define PATH_HOSTSTATS		PATH_STATS "/hoststats"
 
 #ifndef	PATH_LIBEXEC
 #define	PATH_LIBEXEC		"/usr/local/libexec/smtpd"
@@ -187,7 +193,7 @@ union lookup {
  * Bump IMSG_VERSION whenever a change is made to enum imsg_type.
  * This will ensure that we can never use a wrong version of smtpctl with smtpd.
  */
-#define	IMSG_VERSION		16
+#define	IMSG_VERSION		17
 
 enum imsg_type {
 	IMSG_NONE,
@@ -232,6 +238,7 @@ enum imsg_type {
 	IMSG_CTL_SMTP_SESSION,
 
 	IMSG_SETUP_KEY,
+	IMSG_SETUP_WORKER,
 	IMSG_SETUP_PEER,
 	IMSG_SETUP_DONE,
 
@@ -291,6 +298,7 @@ enum imsg_type {
 	IMSG_MTA_DNS_MX,
 	IMSG_MTA_DNS_MX_PREFERENCE,
 	IMSG_MTA_HOLDQ_RELEASE,
+	IMSG_MTA_HOSTSTATS,
 	IMSG_MTA_LOOKUP_CREDENTIALS,
 	IMSG_MTA_LOOKUP_SOURCE,
 	IMSG_MTA_LOOKUP_HELO,
@@ -321,6 +329,7 @@ enum imsg_type {
 	IMSG_SMTP_TLS_VERIFY_CERT,
 	IMSG_SMTP_TLS_VERIFY_CHAIN,
 	IMSG_SMTP_TLS_VERIFY,
+	IMSG_SMTP_TLS_TICKET_KEY,
 
 	IMSG_SMTP_REQ_CONNECT,
 	IMSG_SMTP_REQ_HELO,
@@ -334,7 +343,8 @@ enum imsg_type {
 	IMSG_SMTP_EVENT_DISCONNECT,
 
 	IMSG_CA_PRIVENC,
-	IMSG_CA_PRIVDEC
+	IMSG_CA_PRIVDEC,
+	IMSG_CA_ECDSA_SIGN
 };
 
 enum smtp_proc_type {
@@ -617,6 +627,13 @@ struct smtpd {
 
 	size_t				sc_session_max_rcpt;
 	size_t				sc_session_max_mails;
+	size_t				sc_session_accept_batch;
+	size_t				sc_session_max_per_source;
+	size_t				sc_session_max_per_netblock;
+	size_t				sc_session_rate_per_source;
+	size_t				sc_session_rate_per_netblock;
+
+	int				sc_pony_workers;
 
 	size_t				sc_mda_max_session;
 	size_t				sc_mda_max_user_session;
@@ -661,6 +678,7 @@ struct smtpd {
 	char					sc_enqueue_filter[PATH_MAX];
 
 	char				       *sc_tls_ciphers;
+	int					sc_tls_ktls;
 
 	char				       *sc_subaddressing_delim;
 };
@@ -709,12 +727,38 @@ struct deliver {
 struct filter_conf {
 	int		 chain;
 	int		 done;
+	int		 parallel;
+	time_t		 cachettl;
 	int		 argc;
 	char		*name;
 	char		*argv[MAX_FILTER_ARGS + 1];
 	char		*path;
 };
 
+/* delivery statistics for a MX host or domain, kept across restarts */
+#define MTA_STATS_VERSION	1
+#define MTA_STATS_LATENCY	12	/* buckets of 100ms * 2^i */
+struct mta_stats {
+	char			 name[HOST_NAME_MAX+8];
+	time_t			 tm;
+	uint64_t		 ok;
+	uint64_t		 tempfail;
+	uint64_t		 permfail;
+	uint64_t		 latency[MTA_STATS_LATENCY];
+	size_t			 window;
+	time_t			 tm4xx;
+	time_t			 tm5xx;
+	char			 last4xx[128];
+	char			 last5xx[128];
+};
+
+/* adaptive connection window */
+struct mta_aimd {
+	size_t			 window;
+	size_t			 acked;
+	time_t			 lastcut;
+};
+
 struct mta_host {
 	SPLAY_ENTRY(mta_host)	 entry;
 	struct sockaddr		*sa;
@@ -723,6 +767,7 @@ struct mta_host {
 	size_t			 nconn;
 	time_t			 lastconn;
 	time_t			 lastptrquery;
+	struct mta_aimd		 aimd;
 
 #define HOST_IGNORE	0x01
 	int			 flags;
@@ -740,10 +785,12 @@ struct mta_domain {
 	int			 flags;
 	TAILQ_HEAD(, mta_mx)	 mxs;
 	int			 mxstatus;
+	int			 mxpending;
 	int			 refcount;
 	size_t			 nconn;
 	time_t			 lastconn;
 	time_t			 lastmxquery;
+	struct mta_aimd		 aimd;
 };
 
 struct mta_source {
@@ -782,6 +829,12 @@ struct mta_connector {
 	int				 refcount;
 	size_t				 nconn;
 	time_t				 lastconn;
+	int				 lastfamily;
+
+	/* last mta_find_route() failure, valid until routegen changes */
+	uint64_t			 routegen;
+	int				 routelimits;
+	time_t				 routenext;
 };
 
 struct mta_route {
@@ -792,9 +845,11 @@ struct mta_route {
 #define ROUTE_NEW		0x01
 #define ROUTE_RUNQ		0x02
 #define ROUTE_KEEPALIVE		0x04
+#define ROUTE_STALLED		0x08
 #define ROUTE_DISABLED		0xf0
 #define ROUTE_DISABLED_NET	0x10
 #define ROUTE_DISABLED_SMTP	0x20
+#define ROUTE_CANCEL		0x100
 	int			 flags;
 	int			 nerror;
 	int			 penalty;
@@ -803,6 +858,7 @@ struct mta_route {
 	time_t			 lastconn;
 	time_t			 lastdisc;
 	time_t			 lastpenalty;
+	void			*tls_session;	/* for TLS resumption */
 };
 
 struct mta_limits {
@@ -829,10 +885,13 @@ struct mta_limits {
 	size_t	max_failures_per_session;
 
 	int	family;
+	int	adaptive;
 
 	int	task_hiwat;
 	int	task_lowat;
 	int	task_release;
+	time_t	task_coalesce;
+	size_t	task_max_rcpt;
 };
 
 struct mta_relay {
@@ -857,6 +916,8 @@ struct mta_relay {
 	int			 state;
 	size_t			 ntask;
 	TAILQ_HEAD(, mta_task)	 tasks;
+	size_t			 ntx;
+	size_t			 nrcpt;
 
 	struct tree		 connectors;
 	size_t			 sourceloop;
@@ -905,6 +966,8 @@ struct mta_task {
 	struct mta_relay		*relay;
 	uint32_t			 msgid;
 	TAILQ_HEAD(, mta_envelope)	 envelopes;
+	size_t				 nenvelope;
+	time_t				 creation;
 	char				*sender;
 };
 
@@ -1053,8 +1116,12 @@ extern struct mproc *p_lka;
 extern struct mproc *p_queue;
 extern struct mproc *p_scheduler;
 extern struct mproc *p_pony;
+extern struct mproc *p_ponies[PONY_WORKERS_MAX];
+extern struct mproc *p_cas[PONY_WORKERS_MAX];
 extern struct mproc *p_ca;
 
+extern int pony_worker;
+
 extern struct smtpd	*env;
 extern void (*imsg_callback)(struct mproc *, struct imsg *);
 
@@ -1338,6 +1405,14 @@ void mta_route_ok(struct mta_relay *, struct mta_route *);
 void mta_route_error(struct mta_relay *, struct mta_route *);
 void mta_route_down(struct mta_relay *, struct mta_route *);
 void mta_route_collect(struct mta_relay *, struct mta_route *);
+void mta_route_stalled(struct mta_relay *, struct mta_route *);
+void mta_route_connected(struct mta_relay *, struct mta_route *);
+void mta_route_cancel(struct mta_relay *, struct mta_route *);
+void mta_route_handoff(struct mta_relay *, struct mta_relay *,
+    struct mta_route *);
+void mta_route_feedback(struct mta_relay *, struct mta_route *, const char *,
+    int);
+void mta_stats_merge(struct mta_stats *, const struct mta_stats *);
 void mta_source_error(struct mta_relay *, struct mta_route *, const char *);
 void mta_delivery_log(struct mta_envelope *, const char *, const char *, int, const char *);
 void mta_delivery_notify(struct mta_envelope *);
@@ -1347,7 +1422,8 @@ const char *mta_relay_to_text(struct mta_relay *);
 
 
 /* mta_session.c */
-void mta_session(struct mta_relay *, struct mta_route *);
+void mta_session(struct mta_relay *, struct mta_route *, int);
+int mta_session_reuse(struct mta_relay *, struct mta_route *);
 void mta_session_imsg(struct mproc *, struct imsg *);
 
 
@@ -1369,6 +1445,7 @@ int queue_message_create(uint32_t *);
 int queue_message_delete(uint32_t);
 int queue_message_commit(uint32_t);
 int queue_message_fd_r(uint32_t);
+void queue_message_fd_r_async(uint32_t, void (*)(int, void *), void *);
 int queue_message_fd_rw(uint32_t);
 int queue_message_corrupt(uint32_t);
 int queue_message_uncorrupt(uint32_t);
@@ -1403,7 +1480,7 @@ void smtp_postfork(void);
 void smtp_postprivdrop(void);
 void smtp_imsg(struct mproc *, struct imsg *);
 void smtp_configure(void);
-void smtp_collect(void);
+void smtp_collect(const struct sockaddr_storage *);
 
 
 /* smtp_session.c */
@@ -1416,6 +1493,8 @@ void smtp_filter_fd(uint64_t, int);
 
 /* smtpd.c */
 void imsg_dispatch(struct mproc *, struct imsg *);
+struct mproc *pony_by_id(uint64_t);
+struct mproc *pony_by_key(const char *);
 const char *proc_name(enum smtp_proc_type);
 const char *proc_title(enum smtp_proc_type);
 const char *imsg_to_str(int);
@@ -1426,6 +1505,7 @@ int fork_proc_backend(const char *, const char *, const char *);
 /* ssl_smtpd.c */
 void   *ssl_mta_init(void *, char *, off_t, const char *);
 void   *ssl_smtp_init(void *, int);
+int     ssl_ktls_active(void *);
 
 
 /* stat_backend.c */
@@ -1508,6 +1588,7 @@ int  lowercase(char *, const char *, size_t);
 void xlowercase(char *, const char *, size_t);
 int  uppercase(char *, const char *, size_t);
 uint64_t generate_uid(void);
+void generate_uid_worker(int);
 int availdesc(void);
 int ckdir(const char *, mode_t, uid_t, gid_t, int);
 int rmtree(char *, int);
@@ -41,8 +41,13 @@
 #include <openssl/engine.h>
 #include <openssl/err.h>
 #include <openssl/rsa.h>
+#ifndef OPENSSL_NO_ECDSA
+#include <openssl/ecdsa.h>
+#endif
 #include <openssl/dh.h>
 #include <openssl/bn.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
 
 #include "log.h"
 #include "ssl.h"
@@ -66,6 +71,66 @@ ssl_init(void)
 	inited = 1;
 }
 
+/*
+ * Session ticket keys are generated and rotated by the parent process,
+ * which sends them to every pony worker so that a ticket issued by one
+ * worker can be resumed by another.  The previous key is kept to decrypt
+ * tickets issued before the last rotation.
+ */
+static struct ssl_ticket_key	ssl_ticket_keys[2];
+static int			ssl_ticket_nkeys;
+
+void
+ssl_ticket_key_set(const struct ssl_ticket_key *key)
+{
+	if (ssl_ticket_nkeys)
+		ssl_ticket_keys[1] = ssl_ticket_keys[0];
+	ssl_ticket_keys[0] = *key;
+	if (ssl_ticket_nkeys < 2)
+		ssl_ticket_nkeys++;
+}
+
+static int
+ssl_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	struct ssl_ticket_key	*key;
+	int			 i;
+
+	if (enc) {
+		if (ssl_ticket_nkeys == 0)
+			return (0);
+		key = &ssl_ticket_keys[0];
+		memcpy(name, key->name, sizeof(key->name));
+		arc4random_buf(iv, EVP_MAX_IV_LENGTH);
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+		    key->aes_key, iv))
+			return (-1);
+		if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+		    EVP_sha256(), NULL))
+			return (-1);
+		return (1);
+	}
+
+	for (i = 0; i < ssl_ticket_nkeys; i++)
+		if (memcmp(name, ssl_ticket_keys[i].name,
+		    sizeof(ssl_ticket_keys[i].name)) == 0)
+			break;
+	if (i == ssl_ticket_nkeys)
+		return (0);	/* unknown or expired key, full handshake */
+
+	key = &ssl_ticket_keys[i];
+	if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+	    EVP_sha256(), NULL))
+		return (-1);
+	if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+	    key->aes_key, iv))
+		return (-1);
+
+	/* ask for a new ticket if it was issued under the previous key */
+	return (i == 0 ? 1 : 2);
+}
+
 int
 ssl_setup(SSL_CTX **ctxp, struct pki *pki,
     int (*sni_cb)(SSL *,int *,void *), const char *ciphers)
@@ -76,14 +141,19 @@ ssl_setup(SSL_CTX **ctxp, struct pki *pki,
 	ctx = ssl_ctx_create(pki->pki_name, pki->pki_cert, pki->pki_cert_len, ciphers);
 
 	/*
-	 * Set session ID context to a random value.  We don't support
-	 * persistent caching of sessions so it is OK to set a temporary
-	 * session ID context that is valid during run time.
+	 * Derive the session ID context from the pki name, so that all
+	 * pony workers agree on it and can resume each other's tickets.
 	 */
-	arc4random_buf(sid, sizeof(sid));
+	SHA256((const unsigned char *)pki->pki_name, strlen(pki->pki_name),
+	    sid);
 	if (!SSL_CTX_set_session_id_context(ctx, sid, sizeof(sid)))
 		goto err;
 
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE_SIZE);
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, ssl_ticket_key_cb);
+
 	if (sni_cb)
 		SSL_CTX_set_tlsext_servername_callback(ctx, sni_cb);
 
@@ -359,6 +429,9 @@ ssl_load_pkey(const void *data, size_t datalen, char *buf, off_t len,
 	X509		*x509 = NULL;
 	EVP_PKEY	*pkey = NULL;
 	RSA		*rsa = NULL;
+#ifndef OPENSSL_NO_ECDSA
+	EC_KEY		*eckey = NULL;
+#endif
 	void		*exdata = NULL;
 
 	if ((in = BIO_new_mem_buf(buf, len)) == NULL) {
@@ -381,15 +454,38 @@ ssl_load_pkey(const void *data, size_t datalen, char *buf, off_t len,
 	in = NULL;
 
 	if (data != NULL && datalen) {
-		if ((rsa = EVP_PKEY_get1_RSA(pkey)) == NULL ||
-		    (exdata = malloc(datalen)) == NULL) {
+		if ((exdata = malloc(datalen)) == NULL) {
 			SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY, ERR_R_EVP_LIB);
 			goto fail;
 		}
-
 		memcpy(exdata, data, datalen);
-		RSA_set_ex_data(rsa, 0, exdata);
-		RSA_free(rsa); /* dereference, will be cleaned up with pkey */
+
+		switch (EVP_PKEY_id(pkey)) {
+		case EVP_PKEY_RSA:
+			if ((rsa = EVP_PKEY_get1_RSA(pkey)) == NULL) {
+				SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY,
+				    ERR_R_EVP_LIB);
+				goto fail;
+			}
+			RSA_set_ex_data(rsa, 0, exdata);
+			RSA_free(rsa); /* dereference, will be cleaned up with pkey */
+			break;
+#ifndef OPENSSL_NO_ECDSA
+		case EVP_PKEY_EC:
+			if ((eckey = EVP_PKEY_get1_EC_KEY(pkey)) == NULL) {
+				SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY,
+				    ERR_R_EVP_LIB);
+				goto fail;
+			}
+			ECDSA_set_ex_data(eckey, 0, exdata);
+			EC_KEY_free(eckey); /* dereference, will be cleaned up with pkey */
+			break;
+#endif
+		default:
+			SSLerr(SSL_F_SSL_CTX_USE_PRIVATEKEY,
+			    SSL_R_UNKNOWN_CERTIFICATE_TYPE);
+			goto fail;
+		}
 	}
 
 	*x509ptr = x509;
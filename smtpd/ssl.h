@@ -17,6 +17,14 @@
 
 #define SSL_CIPHERS		"HIGH:!aNULL:!MD5"
 #define	SSL_SESSION_TIMEOUT	300
+#define	SSL_SESSION_CACHE_SIZE	1024
+#define	SSL_TICKET_KEY_ROTATE	(60 * 60)
+
+struct ssl_ticket_key {
+	unsigned char		 name[16];
+	unsigned char		 aes_key[32];
+	unsigned char		 hmac_key[32];
+};
 
 struct pki {
 	char			 pki_name[HOST_NAME_MAX+1];
@@ -52,6 +60,7 @@ int	        ssl_cmp(struct pki *, struct pki *);
 char	       *ssl_load_file(const char *, off_t *, mode_t);
 char	       *ssl_load_key(const char *, off_t *, char *, mode_t, const char *);
 
+void		ssl_ticket_key_set(const struct ssl_ticket_key *);
 const char     *ssl_to_text(const SSL *);
 void		ssl_error(const char *);
 
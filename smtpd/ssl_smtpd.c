@@ -46,6 +46,35 @@
 #include "ssl.h"
 
 
+/*
+ * Ask the TLS library to hand the session keys to the kernel once the
+ * handshake is done.  If the kernel or the negotiated cipher cannot do
+ * it, the library falls back to its own record layer.
+ */
+static void
+ssl_ktls_enable(SSL *ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	if (env->sc_tls_ktls)
+		SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+/*
+ * Return non-zero if the kernel took over the record layer for both
+ * directions of an established session.
+ */
+int
+ssl_ktls_active(void *ssl)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+	return (BIO_get_ktls_send(SSL_get_wbio(ssl)) &&
+	    BIO_get_ktls_recv(SSL_get_rbio(ssl)));
+#else
+	return (0);
+#endif
+}
+
 void *
 ssl_mta_init(void *pkiname, char *cert, off_t cert_len, const char *ciphers)
 {
@@ -59,6 +88,10 @@ ssl_mta_init(void *pkiname, char *cert, off_t cert_len, const char *ciphers)
 	if (!SSL_set_ssl_method(ssl, SSLv23_client_method()))
 		goto err;
 
+	/* allow ticket-based resumption, see mta_tls_resume() */
+	SSL_clear_options(ssl, SSL_OP_NO_TICKET);
+	ssl_ktls_enable(ssl);
+
 	SSL_CTX_free(ctx);
 	return (void *)(ssl);
 
@@ -95,6 +128,7 @@ ssl_smtp_init(void *ssl_ctx, int verify)
 		goto err;
 	if (!SSL_set_ssl_method(ssl, SSLv23_server_method()))
 		goto err;
+	ssl_ktls_enable(ssl);
 
 	return (void *)(ssl);
 
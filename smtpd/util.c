@@ -676,6 +676,8 @@ xlowercase(char *buf, const char *s, size_t len)
 		fatalx("lowercase: truncation");
 }
 
+static int	uid_worker = -1;
+
 uint64_t
 generate_uid(void)
 {
@@ -687,12 +689,27 @@ generate_uid(void)
 		id = arc4random();
 		inited = 1;
 	}
-	while ((uid = ((uint64_t)(id++) << 32 | arc4random())) == 0)
-		;
+	do {
+		uid = (uint64_t)(id++) << 32 | arc4random();
+		if (uid_worker != -1) {
+			uid &= ~((uint64_t)0xff << PONY_WORKER_SHIFT);
+			uid |= (uint64_t)uid_worker << PONY_WORKER_SHIFT;
+		}
+	} while (uid == 0);
 
 	return (uid);
 }
 
+/*
+ * Tag all ids generated from now on with the given pony worker number,
+ * so that other processes can route replies back to the right worker.
+ */
+void
+generate_uid_worker(int worker)
+{
+	uid_worker = worker;
+}
+
 int
 session_socket_error(int fd)
 {